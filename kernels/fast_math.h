@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "math.h"
+
+// cheaper versions of the math.h functions on the kernels' hot paths. every
+// float operation is emulated on the dpu, so they work on the bits where they
+// can and trade a bounded error for fewer float operations:
+//   fast_expf     relative error below 1e-5 on [-87, 88], 0 below and
+//                 infinity above
+//   fast_recipf   relative error below 2e-7 for positive normal floats
+//   fast_sigmoidf absolute error below 1e-6
+//   fast_siluf    relative error below 1e-5
+//   fast_rsqrtf   relative error below 5e-6 for positive normal floats
+// kernels/math_bench.c measures them against the math.h functions.
+
+static uint32_t float_as_uint(float a) {
+  uint32_t r = 0;
+  memcpy(&r, &a, sizeof(r));
+  return r;
+}
+
+static float uint_as_float(uint32_t a) {
+  float r = 0;
+  memcpy(&r, &a, sizeof(r));
+  return r;
+}
+
+// 2^(j/64)
+static const float exp2_table[64] = {
+    1.0f,        1.01088929f, 1.0218972f,  1.03302491f, 1.04427373f,
+    1.05564523f, 1.06714046f, 1.07876074f, 1.09050775f, 1.10238254f,
+    1.1143868f,  1.12652159f, 1.13878858f, 1.15118921f, 1.1637249f,
+    1.17639697f, 1.18920708f, 1.20215678f, 1.21524739f, 1.22848058f,
+    1.24185777f, 1.25538075f, 1.26905096f, 1.28287005f, 1.29683959f,
+    1.31096125f, 1.32523668f, 1.33966756f, 1.35425556f, 1.36900246f,
+    1.38390994f, 1.39897966f, 1.41421354f, 1.42961335f, 1.44518077f,
+    1.46091783f, 1.47682619f, 1.49290776f, 1.50916445f, 1.52559817f,
+    1.54221082f, 1.55900443f, 1.5759809f,  1.59314215f, 1.61049032f,
+    1.62802744f, 1.64575553f, 1.66367662f, 1.68179286f, 1.70010638f,
+    1.71861935f, 1.73733389f, 1.75625217f, 1.77537644f, 1.79470909f,
+    1.81425214f, 1.8340081f,  1.85397911f, 1.87416768f, 1.89457595f,
+    1.91520655f, 1.93606174f, 1.95714414f, 1.97845602f,
+};
+
+// exp(x) = 2^(n/64 + f/64) with n an integer and |f| <= 1/2: the exponent
+// and table index come from the bits of n, 2^(f/64) from a quadratic. the
+// ranges are checked on the bits as well, no special cases otherwise.
+float fast_expf(float x) {
+  const uint32_t bits = float_as_uint(x);
+  if (bits > 0xc2ae0000u) { // below -87, the result would be denormal
+    return 0.0f;
+  }
+  if (bits > 0x42b00000u && bits < 0x80000000u) { // above 88
+    return INFINITY;
+  }
+
+  // rounds t to an integer in the low bits of the mantissa
+  const float t = x * 92.3324826f; // 64 / ln(2)
+  const float rounded = t + 12582912.0f;
+  const int32_t n = (int32_t)(float_as_uint(rounded) - 0x4b400000u);
+  const float f = t - (rounded - 12582912.0f);
+  const float p = 1.0f + f * (1.08304247e-2f + f * 5.86490258e-5f);
+  const float r = exp2_table[n & 63] * p;
+  return uint_as_float(float_as_uint(r) + ((uint32_t)(n >> 6) << 23));
+}
+
+// 1 / d, three newton iterations from a guess on the bits
+float fast_recipf(float d) {
+  float y = uint_as_float(0x7ef311c3u - float_as_uint(d));
+  y = y * (2.0f - d * y);
+  y = y * (2.0f - d * y);
+  y = y * (2.0f - d * y);
+  return y;
+}
+
+float fast_sigmoidf(float x) {
+  if (float_as_uint(x) > 0xc2a00000u) { // below -80, 1 + exp(-x) overflows
+    return 0.0f;                        // the guess of fast_recipf()
+  }
+  return fast_recipf(1.0f + fast_expf(-x));
+}
+
+// the activation of the ffn
+float fast_siluf(float x) { return x * fast_sigmoidf(x); }
+
+// 1 / sqrt(x), two newton iterations from a guess on the bits
+float fast_rsqrtf(float x) {
+  const float half = 0.5f * x;
+  float y = uint_as_float(0x5f375a86u - (float_as_uint(x) >> 1));
+  y = y * (1.5f - half * y * y);
+  y = y * (1.5f - half * y * y);
+  return y;
+}
@@ -0,0 +1,195 @@
+#include <alloc.h>
+#include <barrier.h>
+#include <defs.h>
+#include <mram.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fast_math.h"
+#include "matvec.h"
+#include "model_config.h"
+
+// the matvec stages are all this kernel, the Makefile specializes it with
+//   GEMV_ROWS      rows of a matrix per layer on a dpu its mram holds
+//   GEMV_COLS      columns of the matrices its mram holds
+//   GEMV_LAYERS    layers of weights, default MAX_N_LAYERS
+//   GEMV_MATRICES  matrices multiplied with the same input, default 1
+//   GEMV_NORM      rmsnorm the input with the layer's rms_w first
+//   GEMV_EPILOGUE  what becomes of the products:
+#define GEMV_STORE 0    // written to out (cls)
+#define GEMV_RESIDUAL 1 // added to the residual in out (attout, ffn2)
+#define GEMV_SILU 2     // silu(w1 x) * (w3 x) of w = {w1, w3} (ffn1)
+#define GEMV_ROPE 3     // w = {wq, wk, wv}, q and k rotated (qkv)
+
+#ifndef GEMV_LAYERS
+#define GEMV_LAYERS MAX_N_LAYERS
+#endif
+#ifndef GEMV_MATRICES
+#define GEMV_MATRICES 1
+#endif
+
+#if GEMV_EPILOGUE == GEMV_SILU
+#if GEMV_MATRICES != 2
+#error "silu takes the products of w1 and w3"
+#endif
+// both products are combined into one output
+#define GEMV_OUTPUTS 1
+#elif GEMV_EPILOGUE == GEMV_ROPE
+#if GEMV_MATRICES != 3
+#error "rope takes q, k and v"
+#endif
+#define GEMV_OUTPUTS 3
+#else
+#define GEMV_OUTPUTS GEMV_MATRICES
+#endif
+
+// weights of all layers: layer x rows x cols per matrix, plus the scales of
+// every row for q8 builds. wk and wv only have the rows of the kv heads.
+weight_t __mram_noinit w[GEMV_MATRICES][GEMV_LAYERS * GEMV_ROWS * GEMV_COLS];
+float __mram_noinit
+    w_s[GEMV_MATRICES][GEMV_LAYERS * GEMV_ROWS * MAX_SCALES(GEMV_COLS)];
+#ifdef GEMV_NORM
+#include "rmsnorm.h"
+
+float __mram_noinit rms_w[GEMV_LAYERS * GEMV_COLS];
+#endif
+#if GEMV_EPILOGUE == GEMV_ROPE
+// cos and sin of the rotation of every position and pair of a head, written
+// once by the host: seq_len x head_size
+float __mram_noinit rope_table[MAX_SEQ_LEN * MAX_HEAD_SIZE];
+#endif
+
+// written by the host in a single transfer per launch: the arguments, the
+// input of every sequence (batch x cols) and for GEMV_RESIDUAL the residual
+// of this dpu's rows (batch x rows)
+__mram_noinit struct {
+  GemvArgs args;
+#if GEMV_EPILOGUE == GEMV_RESIDUAL
+  float data[MAX_BATCH * (GEMV_COLS + GEMV_ROWS)];
+#else
+  float data[MAX_BATCH * GEMV_COLS];
+#endif
+} in;
+
+// read by the host in a single transfer: the outputs one after the other,
+// batch x rows each
+float __mram_noinit out[GEMV_OUTPUTS * MAX_BATCH * GEMV_ROWS];
+
+__mram_noinit ModelConfig config;
+
+BARRIER_INIT(barrier, NR_TASKLETS);
+
+#if GEMV_EPILOGUE == GEMV_ROPE
+// rotates a pair of rows of q or k, v holds row i of the full vector for
+// every token followed by row i + 1
+static void rope(float *v, size_t i, size_t batch) {
+  // RoPE relative positional encoding: complex-valued rotate q and k in
+  // each head
+  const size_t head_size = config.head_size;
+  const size_t head_dim = i % head_size;
+  __dma_aligned float cs[2];
+  for (size_t b = 0; b < batch; b++) {
+    mram_read(rope_table + in.args.pos[b] * head_size + head_dim, cs,
+              sizeof(cs));
+    const float fcr = cs[0];
+    const float fci = cs[1];
+    const float v0 = v[b];
+    const float v1 = v[batch + b];
+    v[b] = v0 * fcr - v1 * fci;
+    v[batch + b] = v0 * fci + v1 * fcr;
+  }
+}
+#endif
+
+// multiplies the tasklet's rows of matrix m, rows of them per layer on this
+// dpu, with every token into o (batch x rows). wram_r holds a tile of
+// products of each matrix used together, wram_o a tile of outputs.
+static void gemv(size_t m, size_t rows, __mram_ptr float *o, void *wram_w,
+                 float *wram_r, float *wram_o) {
+  const size_t n = config.cols;
+  const size_t batch = in.args.batch;
+  const size_t scales = matvec_scales(n);
+  size_t first, count;
+  matvec_rows(rows, &first, &count);
+  for (size_t i = first; i < first + count; i += MATVEC_TILE_ROWS) {
+    const size_t tile = matvec_tile(first + count - i);
+    const size_t row = in.args.layer * rows + i;
+    matvec_dot(w[m] + row * n, w_s[m] + row * scales, tile, wram_w, wram_r);
+
+#if GEMV_EPILOGUE == GEMV_SILU
+    float *wram_r3 = wram_r + MATVEC_TILE_ROWS * batch;
+    matvec_dot(w[1] + row * n, w_s[1] + row * scales, tile, wram_w, wram_r3);
+    for (size_t j = 0; j < tile * batch; j++) {
+      wram_r[j] = fast_siluf(wram_r[j]) * wram_r3[j];
+    }
+#elif GEMV_EPILOGUE == GEMV_ROPE
+    if (m < 2) {
+      for (size_t r = 0; r < tile; r += 2) {
+        rope(wram_r + r * batch, config.dpu * rows + i + r, batch);
+      }
+    }
+#endif
+
+    // the rows of a tasklet start 8 byte aligned, so each writes its own
+    for (size_t b = 0; b < batch; b++) {
+#if GEMV_EPILOGUE == GEMV_RESIDUAL
+      mram_read(in.data + batch * n + b * rows + i, wram_o,
+                tile * sizeof(float));
+      for (size_t r = 0; r < tile; r++) {
+        wram_o[r] += wram_r[r * batch + b];
+      }
+#else
+      for (size_t r = 0; r < tile; r++) {
+        wram_o[r] = wram_r[r * batch + b];
+      }
+#endif
+      mram_write(wram_o, o + b * rows + i, tile * sizeof(float));
+    }
+  }
+}
+
+int main(void) {
+  const size_t tasklet_id = me();
+  const size_t n = config.cols;
+  const size_t rows = config.rows;
+  const size_t batch = in.args.batch;
+  if (tasklet_id == 0) { // Initialize once the cycle counter
+    mem_reset();         // Reset the heap
+    matvec_init(n, batch, config.group_size);
+  }
+  barrier_wait(&barrier);
+
+  void *wram_w = mem_alloc(MATVEC_BUFFER_SIZE);
+#if GEMV_EPILOGUE == GEMV_SILU
+  float *wram_r = mem_alloc(2 * MATVEC_TILE_ROWS * batch * sizeof(float));
+#else
+  float *wram_r = mem_alloc(MATVEC_TILE_ROWS * batch * sizeof(float));
+#endif
+  float *wram_o = mem_alloc(MATVEC_TILE_ROWS * sizeof(float));
+
+#ifdef GEMV_NORM
+  rmsnorm(matvec_x, in.data, rms_w + in.args.layer * n, n, batch);
+#else
+  matvec_load(in.data);
+  barrier_wait(&barrier);
+#endif
+  matvec_quantize();
+
+#if GEMV_EPILOGUE == GEMV_ROPE
+  // query heads share the kv heads, so every dpu has as many fewer k and v
+  // rows. the rows of each matrix are balanced over the tasklets.
+  const size_t kv_rows = rows * config.n_kv_heads / config.n_heads;
+  __mram_ptr float *k = out + batch * rows;
+  __mram_ptr float *v = k + batch * kv_rows;
+  gemv(0, rows, out, wram_w, wram_r, wram_o);
+  gemv(1, kv_rows, k, wram_w, wram_r, wram_o);
+  gemv(2, kv_rows, v, wram_w, wram_r, wram_o);
+#else
+  gemv(0, rows, out, wram_w, wram_r, wram_o);
+#endif
+
+  matvec_done();
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <defs.h>
+#include <mram.h>
+#include <perfcounter.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fast_math.h"
+#include "math.h"
+
+// cycles per call of the math.h functions and their fast_math.h versions on
+// one tasklet, over N_INPUTS inputs from the range the kernels call them
+// with, and the largest error of the fast ones
+#define N_INPUTS 256
+
+static float recipf(float x) { return 1.0f / x; }
+
+static float sigmoidf(float x) { return 1.0f / (1.0f + expf(-x)); }
+
+static float siluf(float x) { return x * sigmoidf(x); }
+
+static const struct {
+  float (*f)(float);
+  float (*fast)(float);
+  float min, max;
+  bool geometric; // inputs spaced by a factor instead of a difference
+  bool absolute;  // absolute instead of relative error
+} functions[] = {
+    // exp(score - max) of the softmax
+    {expf, fast_expf, -20.0f, 0.0f, false, false},
+    // 1 + exp(-x) of the sigmoid
+    {recipf, fast_recipf, 1.0f, 1e4f, true, false},
+    {sigmoidf, fast_sigmoidf, -10.0f, 10.0f, false, true},
+    {siluf, fast_siluf, -10.0f, 10.0f, false, false},
+    // mean square of the rmsnorm
+    {isqrtf, fast_rsqrtf, 1e-3f, 1e3f, true, false},
+};
+#define N_FUNCTIONS (sizeof(functions) / sizeof(functions[0]))
+
+struct Result {
+  uint32_t cycles;      // per call of the math.h function
+  uint32_t fast_cycles; // and of the fast_math.h one
+  float error;
+  uint32_t padding;
+};
+
+__mram_noinit struct Result results[N_FUNCTIONS];
+
+float input[N_INPUTS];
+float output[N_INPUTS];
+float fast_output[N_INPUTS];
+
+static uint32_t cycles_per_call(float (*f)(float), float *out) {
+  perfcounter_config(COUNT_CYCLES, true);
+  const perfcounter_t start = perfcounter_get();
+  for (size_t i = 0; i < N_INPUTS; i++) {
+    out[i] = f(input[i]);
+  }
+  return (perfcounter_get() - start) / N_INPUTS;
+}
+
+int main(void) {
+  for (size_t f = 0; f < N_FUNCTIONS; f++) {
+    const float min = functions[f].min;
+    const float max = functions[f].max;
+    input[0] = min;
+    if (functions[f].geometric) {
+      // the (N_INPUTS - 1)th root of max / min
+      const float factor = expf(logf(max / min) / (N_INPUTS - 1));
+      for (size_t i = 1; i < N_INPUTS; i++) {
+        input[i] = input[i - 1] * factor;
+      }
+    } else {
+      for (size_t i = 1; i < N_INPUTS; i++) {
+        input[i] = min + (max - min) * i / (N_INPUTS - 1);
+      }
+    }
+
+    __dma_aligned struct Result result = {0};
+    result.cycles = cycles_per_call(functions[f].f, output);
+    result.fast_cycles = cycles_per_call(functions[f].fast, fast_output);
+    for (size_t i = 0; i < N_INPUTS; i++) {
+      float error = fabsf(fast_output[i] - output[i]);
+      if (!functions[f].absolute && output[i] != 0.0f) {
+        error /= fabsf(output[i]);
+      }
+      if (error > result.error) {
+        result.error = error;
+      }
+    }
+    mram_write(&result, &results[f], sizeof(result));
+  }
+  return 0;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <alloc.h>
+#include <barrier.h>
+#include <defs.h>
+#include <mram.h>
+#include <perfcounter.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "math.h"
+#include "model_config.h"
+
+// rows can be longer than a single dma transfer (2048 bytes), so they are
+// streamed through a wram buffer of MATVEC_CHUNK floats. the transfers run
+// on over the consecutive rows of a tile, so short rows share them.
+#define MATVEC_CHUNK 256
+
+// consecutive rows a tasklet multiplies at a time, the output of a tile
+// takes MATVEC_TILE_ROWS x batch floats of wram
+#define MATVEC_TILE_ROWS 4
+
+// q8 builds (-DQ8) keep int8 weights with a float scale per group of
+// config.group_size weights. the scales of a row are padded to an even count,
+// so every row of scales starts 8 byte aligned.
+
+#ifdef Q8
+typedef int8_t weight_t;
+// int8 weights per chunk
+#define MATVEC_Q8_CHUNK (MATVEC_CHUNK * 2)
+// a chunk of int8 weights followed by the scales of a row
+#define MATVEC_BUFFER_SIZE                                                     \
+  (MATVEC_Q8_CHUNK + MAX_SCALES(MAX_HIDDEN_DIM) * sizeof(float))
+#else
+typedef float weight_t;
+#define MATVEC_BUFFER_SIZE (MATVEC_CHUNK * sizeof(float))
+#endif
+
+// the vectors every row is multiplied with, one per sequence of the batch
+// (batch x n floats), shared by all tasklets. q8 builds quantize them per
+// group as well, so the dot products run on int8.
+static float *matvec_x;
+static size_t matvec_n;
+static size_t matvec_batch;
+static size_t matvec_group_size;
+#ifdef Q8
+static int8_t *matvec_xq;
+static float *matvec_xs;
+#endif
+
+BARRIER_INIT(matvec_barrier, NR_TASKLETS);
+
+// cycles of the last launch, the host reads them from one dpu of the set
+__mram_noinit uint64_t cycles;
+
+// allocates the shared vectors and starts the cycle counter, called by
+// tasklet 0 after mem_reset()
+static void matvec_init(size_t n, size_t batch, size_t group_size) {
+  perfcounter_config(COUNT_CYCLES, true);
+  matvec_x = mem_alloc(batch * n * sizeof(float));
+  matvec_n = n;
+  matvec_batch = batch;
+  matvec_group_size = group_size;
+#ifdef Q8
+  matvec_xq = mem_alloc(batch * n);
+  matvec_xs = mem_alloc(batch * MAX_SCALES(n) * sizeof(float));
+#endif
+}
+
+// every tasklet copies its slice of each vector of x (batch x n floats) into
+// matvec_x. n has to split into an even number of floats per tasklet, the
+// caller waits on a barrier before using them.
+static inline void matvec_load(__mram_ptr float *x) {
+  const size_t chunk_size = matvec_n / NR_TASKLETS;
+  for (size_t b = 0; b < matvec_batch; b++) {
+    const size_t chunk_start = b * matvec_n + me() * chunk_size;
+    mram_read(x + chunk_start, matvec_x + chunk_start,
+              chunk_size * sizeof(float));
+  }
+}
+
+// the rows [*first, *first + *count) of the tasklet, consecutive pairs of
+// rows balanced over the tasklets
+static void matvec_rows(size_t rows, size_t *first, size_t *count) {
+  const size_t pairs = rows / 2;
+  const size_t begin = me() * pairs / NR_TASKLETS;
+  const size_t end = (me() + 1) * pairs / NR_TASKLETS;
+  *first = begin * 2;
+  *count = (end - begin) * 2;
+}
+
+// rows of the next tile when rest rows are left
+static size_t matvec_tile(size_t rest) {
+  return rest < MATVEC_TILE_ROWS ? rest : MATVEC_TILE_ROWS;
+}
+
+// records the cycles of the launch once all tasklets are done, every tasklet
+// has to call it
+static void matvec_done(void) {
+  barrier_wait(&matvec_barrier);
+  if (me() == 0) {
+    __dma_aligned uint64_t total = perfcounter_get();
+    mram_write(&total, &cycles, sizeof(total));
+  }
+}
+
+// scales per row of n weights, as laid out by the host
+static size_t matvec_scales(size_t n) {
+#ifdef Q8
+  return (n / matvec_group_size + 1) & ~1u;
+#else
+  (void)n;
+  return 0;
+#endif
+}
+
+// quantizes matvec_x once all tasklets have written their part, a no-op for
+// float builds. every tasklet has to call it.
+static void matvec_quantize(void) {
+#ifdef Q8
+  const size_t gs = matvec_group_size;
+  // the groups of all vectors are contiguous
+  for (size_t g = me(); g < matvec_batch * matvec_n / gs; g += NR_TASKLETS) {
+    float *x = matvec_x + g * gs;
+    float max_val = 0.0f;
+    for (size_t i = 0; i < gs; i++) {
+      max_val = fabsf(x[i]) > max_val ? fabsf(x[i]) : max_val;
+    }
+    const float inv_scale = max_val > 0.0f ? 127.0f / max_val : 0.0f;
+    for (size_t i = 0; i < gs; i++) {
+      const float q = x[i] * inv_scale;
+      matvec_xq[g * gs + i] = (int8_t)(q >= 0.0f ? q + 0.5f : q - 0.5f);
+    }
+    matvec_xs[g] = max_val / 127.0f;
+  }
+  barrier_wait(&matvec_barrier);
+#endif
+}
+
+// dot products of count consecutive rows of matvec_n weights in mram with
+// every vector of matvec_x into out[count x batch]. the rows are streamed
+// once for the whole batch in transfers of up to a chunk, which can span the
+// end of a row. q8 builds accumulate every group in int32 and apply both
+// scales once per group. buf holds MATVEC_BUFFER_SIZE bytes.
+static void matvec_dot(__mram_ptr weight_t *rows, __mram_ptr float *scales,
+                       size_t count, void *buf, float *out) {
+  const size_t n = matvec_n;
+  const size_t batch = matvec_batch;
+  const size_t total = count * n;
+  for (size_t i = 0; i < count * batch; i++) {
+    out[i] = 0.0f;
+  }
+  // the row and column of the next weight
+  size_t r = 0;
+  size_t col = 0;
+#ifdef Q8
+  const size_t gs = matvec_group_size;
+  const size_t groups = n / gs;
+  const size_t row_scales = matvec_scales(n);
+  // whole groups per transfer
+  const size_t chunk = MATVEC_Q8_CHUNK / gs * gs;
+  int8_t *w = buf;
+  float *s = (float *)(w + MATVEC_Q8_CHUNK);
+  mram_read(scales, s, row_scales * sizeof(float));
+
+  for (size_t i = 0; i < total; i += chunk) {
+    const size_t chunk_size = total - i < chunk ? total - i : chunk;
+    mram_read(rows + i, w, chunk_size);
+    for (size_t g = 0; g < chunk_size; g += gs) {
+      if (col == n) {
+        r++;
+        col = 0;
+        mram_read(scales + r * row_scales, s, row_scales * sizeof(float));
+      }
+      const size_t group = col / gs;
+      for (size_t b = 0; b < batch; b++) {
+        const int8_t *x = matvec_xq + b * n + col;
+        int32_t acc = 0;
+        for (size_t j = 0; j < gs; j++) {
+          acc += (int32_t)w[g + j] * x[j];
+        }
+        out[r * batch + b] +=
+            (float)acc * s[group] * matvec_xs[b * groups + group];
+      }
+      col += gs;
+    }
+  }
+#else
+  (void)scales;
+  float *w = buf;
+  for (size_t i = 0; i < total; i += MATVEC_CHUNK) {
+    const size_t chunk_size =
+        total - i < MATVEC_CHUNK ? total - i : MATVEC_CHUNK;
+    mram_read(rows + i, w, chunk_size * sizeof(float));
+    for (size_t j = 0; j < chunk_size;) {
+      const size_t len = n - col < chunk_size - j ? n - col : chunk_size - j;
+      for (size_t b = 0; b < batch; b++) {
+        out[r * batch + b] += dot(w + j, matvec_x + b * n + col, len);
+      }
+      j += len;
+      col += len;
+      if (col == n) {
+        r++;
+        col = 0;
+      }
+    }
+  }
+#endif
+}
@@ -8,95 +8,179 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#include "math.h"
+#include "fast_math.h"
 #include "model_config.h"
 
-float __mram_noinit att[SEQ_LEN];
-float __mram_noinit q[HEAD_SIZE];
-float __mram_noinit kc[SEQ_LEN * HEAD_SIZE];
-float __mram_noinit vc[HEAD_SIZE * SEQ_LEN];
-float __mram_noinit x[HEAD_SIZE];
+// query heads of one pass over the cache. every tasklet accumulates the
+// values of all of them, ACC_SIZE floats bound its wram.
+#define ACC_SIZE (2 * MAX_HEAD_SIZE)
+#define MAX_PASS_HEADS 8
 
+// the dpu holds one kv head and the query heads sharing it, kv_mul of them.
+// the host writes the arguments, q, k and v in a single transfer per launch.
+// q, x: batch x kv_mul x head_size
+// k, v: batch x head_size
 __mram_noinit struct {
-  float scale;
-  uint32_t pos;
-} data;
+  MhaArgs args;
+  float data[MAX_BATCH * (MAX_DIM + 2 * MAX_HEAD_SIZE)];
+} in;
+float __mram_noinit x[MAX_BATCH * MAX_DIM];
+
+// kv cache of all layers for the kv head of this dpu, one slot per sequence
+// and a row per position. the kernel inserts k and v of the current
+// positions.
+// kc, vc: slot x layer x seq_len x head_size
+float __mram_noinit kc[KV_CACHE_SIZE];
+float __mram_noinit vc[KV_CACHE_SIZE];
+
+__mram_noinit ModelConfig config;
 
 BARRIER_INIT(barrier, NR_TASKLETS);
-BARRIER_INIT(softmax_barrier, NR_TASKLETS);
-BARRIER_INIT(softmax_done_barrier, NR_TASKLETS);
+BARRIER_INIT(merge_barrier, NR_TASKLETS);
+BARRIER_INIT(output_barrier, NR_TASKLETS);
+
+// shared by all tasklets
+float *wram_q;
+float *wram_x;
+// max score, sum of exponentials relative to it and the values weighted by
+// them over the positions of every tasklet, for each head of the pass
+float partial_max[NR_TASKLETS][MAX_PASS_HEADS];
+float partial_sum[NR_TASKLETS][MAX_PASS_HEADS];
+float *partial_x[NR_TASKLETS];
 
 int main(void) {
   const size_t tasklet_id = me();
+  const size_t head_size = config.head_size;
+  const size_t seq_len = config.seq_len;
+  const size_t layer = in.args.layer;
+  const size_t kv_mul = config.n_heads / config.n_kv_heads;
+  const size_t q_size = kv_mul * head_size;
+  __mram_ptr float *q = in.data;
+  __mram_ptr float *k = q + in.args.batch * q_size;
+  __mram_ptr float *v = k + in.args.batch * head_size;
+  size_t pass_heads = ACC_SIZE / head_size;
+  if (pass_heads > MAX_PASS_HEADS) {
+    pass_heads = MAX_PASS_HEADS;
+  }
   if (tasklet_id == 0) { // Initialize once the cycle counter
     mem_reset();         // Reset the heap
+    wram_q = mem_alloc(q_size * sizeof(float));
+    wram_x = mem_alloc(q_size * sizeof(float));
   }
   barrier_wait(&barrier);
 
-  float *wram_att = mem_alloc(SEQ_LEN * sizeof(float));
-
-  if (tasklet_id < 16) {
-    const size_t chunk_size = (SEQ_LEN / 16);
-    const size_t chunk_start = tasklet_id * chunk_size;
-
-    float *wram_q = mem_alloc(HEAD_SIZE * sizeof(float));
-    float *wram_kc = mem_alloc(HEAD_SIZE * sizeof(float));
-    mram_read(q, wram_q, HEAD_SIZE * sizeof(float));
-
-    for (size_t i = 0; i < chunk_size; i++) {
-      const size_t t = chunk_start + i;
-      if (t <= data.pos) {
-        mram_read(kc + t * HEAD_SIZE, wram_kc, HEAD_SIZE * sizeof(float));
-        wram_att[i] = dot(wram_q, wram_kc, HEAD_SIZE) / data.scale;
-      } else {
-        wram_att[i] = -INFINITY;
+  float *wram_k = mem_alloc(head_size * sizeof(float));
+  float *wram_v = mem_alloc(head_size * sizeof(float));
+  float *acc = mem_alloc(ACC_SIZE * sizeof(float));
+  partial_x[tasklet_id] = acc;
+
+  // attention has no weights to share, the tokens take turns. tokens of the
+  // same sequence come in order, so each sees the k and v of the ones before.
+  for (size_t b = 0; b < in.args.batch; b++) {
+    const size_t pos = in.args.pos[b];
+    const size_t offset =
+        (in.args.slot[b] * config.n_layers + layer) * seq_len * head_size;
+    if (tasklet_id == 0) {
+      // append k and v to the cache before any tasklet reads them
+      mram_read(k + b * head_size, wram_k, head_size * sizeof(float));
+      mram_write(wram_k, kc + offset + pos * head_size,
+                 head_size * sizeof(float));
+      mram_read(v + b * head_size, wram_v, head_size * sizeof(float));
+      mram_write(wram_v, vc + offset + pos * head_size,
+                 head_size * sizeof(float));
+      // a head at a time, q can exceed a single dma transfer
+      for (size_t i = 0; i < q_size; i += head_size) {
+        mram_read(q + b * q_size + i, wram_q + i, head_size * sizeof(float));
       }
     }
+    barrier_wait(&barrier);
 
-    mram_write(wram_att, att + chunk_start, chunk_size * sizeof(float));
-  }
-
-  barrier_wait(&softmax_barrier);
-  if (tasklet_id == 0) {
-    mram_read(att, wram_att, SEQ_LEN * sizeof(float));
-
-    float max_val = wram_att[0];
-    for (int i = 1; i < SEQ_LEN; i++) {
-      if (wram_att[i] > max_val) {
-        max_val = wram_att[i];
-      }
+    if (in.args.kv_only) {
+      continue;
     }
 
-    float sum = 0.0f;
-    for (int i = 0; i < SEQ_LEN; i++) {
-      wram_att[i] = expf(wram_att[i] - max_val);
-      sum += wram_att[i];
-    }
+    // the query heads of the kv head are attended in passes over the cache.
+    // every tasklet streams its range of positions once per pass, rescaling
+    // the sum and values of a head whenever its max score grows. positions
+    // after pos are never written, so they are never read either.
+    const size_t n = pos + 1;
+    const float scale = in.args.scale;
+    for (size_t h0 = 0; h0 < kv_mul; h0 += pass_heads) {
+      const size_t heads = kv_mul - h0 < pass_heads ? kv_mul - h0 : pass_heads;
+      float max[MAX_PASS_HEADS];
+      float sum[MAX_PASS_HEADS];
+      for (size_t h = 0; h < heads; h++) {
+        max[h] = -INFINITY;
+        sum[h] = 0.0f;
+      }
+      for (size_t i = 0; i < heads * head_size; i++) {
+        acc[i] = 0.0f;
+      }
+      for (size_t t = tasklet_id * n / NR_TASKLETS;
+           t < (tasklet_id + 1) * n / NR_TASKLETS; t++) {
+        mram_read(kc + offset + t * head_size, wram_k,
+                  head_size * sizeof(float));
+        mram_read(vc + offset + t * head_size, wram_v,
+                  head_size * sizeof(float));
+        for (size_t h = 0; h < heads; h++) {
+          float *acc_h = acc + h * head_size;
+          const float score =
+              dot(wram_q + (h0 + h) * head_size, wram_k, head_size) / scale;
+          if (score > max[h]) {
+            const float correction = fast_expf(max[h] - score);
+            sum[h] *= correction;
+            for (size_t i = 0; i < head_size; i++) {
+              acc_h[i] *= correction;
+            }
+            max[h] = score;
+          }
+          const float e = fast_expf(score - max[h]);
+          sum[h] += e;
+          for (size_t i = 0; i < head_size; i++) {
+            acc_h[i] += e * wram_v[i];
+          }
+        }
+      }
+      for (size_t h = 0; h < heads; h++) {
+        partial_max[tasklet_id][h] = max[h];
+        partial_sum[tasklet_id][h] = sum[h];
+      }
+      barrier_wait(&merge_barrier);
+
+      // log-sum-exp merge of the partials, the dimensions are interleaved
+      // over the tasklets. tasklets without positions have a sum of zero.
+      for (size_t h = 0; h < heads; h++) {
+        float global_max = -INFINITY;
+        for (size_t j = 0; j < NR_TASKLETS; j++) {
+          if (partial_sum[j][h] > 0.0f && partial_max[j][h] > global_max) {
+            global_max = partial_max[j][h];
+          }
+        }
+        float weight[NR_TASKLETS];
+        float total = 0.0f;
+        for (size_t j = 0; j < NR_TASKLETS; j++) {
+          weight[j] = partial_sum[j][h] > 0.0f
+                          ? fast_expf(partial_max[j][h] - global_max)
+                          : 0.0f;
+          total += weight[j] * partial_sum[j][h];
+        }
+        for (size_t i = tasklet_id; i < head_size; i += NR_TASKLETS) {
+          float x_i = 0.0f;
+          for (size_t j = 0; j < NR_TASKLETS; j++) {
+            x_i += weight[j] * partial_x[j][h * head_size + i];
+          }
+          wram_x[(h0 + h) * head_size + i] = x_i / total;
+        }
+      }
 
-    for (int i = 0; i < SEQ_LEN; i++) {
-      wram_att[i] /= sum;
+      // the next pass and token reuse the accumulators and shared buffers
+      barrier_wait(&output_barrier);
     }
-
-    mram_write(wram_att, att, SEQ_LEN * sizeof(float));
-  }
-  barrier_wait(&softmax_done_barrier);
-
-  if (tasklet_id < 12) {
-    const size_t chunk_size = (HEAD_SIZE / 12);
-    const size_t chunk_start = tasklet_id * chunk_size;
-
-    float *wram_vc = mem_alloc(SEQ_LEN * sizeof(float));
-    float *wram_x = mem_alloc(chunk_size * sizeof(float));
-
-    mram_read(att, wram_att, SEQ_LEN * sizeof(float));
-
-    for (size_t i = 0; i < chunk_size; i++) {
-      mram_read(vc + (chunk_start + i) * SEQ_LEN, wram_vc,
-                SEQ_LEN * sizeof(float));
-      wram_x[i] = dot(wram_att, wram_vc, SEQ_LEN);
+    if (tasklet_id == 0) {
+      for (size_t i = 0; i < q_size; i += head_size) {
+        mram_write(wram_x + i, x + b * q_size + i, head_size * sizeof(float));
+      }
     }
-
-    mram_write(wram_x, x + chunk_start, chunk_size * sizeof(float));
   }
 
   return 0;
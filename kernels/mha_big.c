@@ -10,47 +10,36 @@
 
 #include "math.h"
 
-#define SEQ_LEN 256
+// a shard of up to SHARD_LEN consecutive positions of one head, the host
+// splits longer sequences over several dpus and merges their outputs
+#define SHARD_LEN 256
 #define HEAD_SIZE 4096
 
-float __mram_noinit att[SEQ_LEN];
 float __mram_noinit q[HEAD_SIZE];
-float __mram_noinit kc[SEQ_LEN * HEAD_SIZE];
-float __mram_noinit vc[HEAD_SIZE * SEQ_LEN];
+float __mram_noinit kc[SHARD_LEN * HEAD_SIZE];
+float __mram_noinit vc[HEAD_SIZE * SHARD_LEN];
+// values weighted by exp(score - max) over the positions of the shard, the
+// host normalizes them once all shards are merged
 float __mram_noinit x[HEAD_SIZE];
 
+__mram_noinit struct {
+  float max; // of the scores of the shard
+  float sum; // of exp(score - max)
+} partial;
+
 __mram_noinit struct {
   float scale;
-  uint32_t pos;
+  uint32_t len; // positions in the shard
 } data;
 
 BARRIER_INIT(barrier, NR_TASKLETS);
-BARRIER_INIT(softmax_barrier, NR_TASKLETS);
-BARRIER_INIT(softmax_done_barrier, NR_TASKLETS);
-
-void softmax() {
-  float *wram_att = mem_alloc(SEQ_LEN * sizeof(float));
-  mram_read(att, wram_att, SEQ_LEN * sizeof(float));
-
-  float max_val = wram_att[0];
-  for (int i = 1; i < SEQ_LEN; i++) {
-    if (wram_att[i] > max_val) {
-      max_val = wram_att[i];
-    }
-  }
+BARRIER_INIT(max_barrier, NR_TASKLETS);
+BARRIER_INIT(sum_barrier, NR_TASKLETS);
 
-  float sum = 0.0f;
-  for (int i = 0; i < SEQ_LEN; i++) {
-    wram_att[i] = expf(wram_att[i] - max_val);
-    sum += wram_att[i];
-  }
-
-  for (int i = 0; i < SEQ_LEN; i++) {
-    wram_att[i] /= sum;
-  }
-
-  mram_write(wram_att, att, SEQ_LEN * sizeof(float));
-}
+// shared by all tasklets
+float wram_att[SHARD_LEN];
+float partial_max[NR_TASKLETS];
+float partial_sum[NR_TASKLETS];
 
 size_t chunk_size_for_tasklet(size_t data_size, size_t tasklet_id) {
   return (data_size / NR_TASKLETS) +
@@ -72,51 +61,74 @@ int main(void) {
   }
   barrier_wait(&barrier);
 
-  {
-    const size_t chunk_size = chunk_size_for_tasklet(SEQ_LEN, tasklet_id);
-    const size_t chunk_offset = chunk_offset_for_tasklet(SEQ_LEN, tasklet_id);
+  const size_t len = data.len;
+  // the segments of q and kc, later of x and vc
+  float *wram_a = mem_alloc(128 * sizeof(float));
+  float *wram_b = mem_alloc(128 * sizeof(float));
+  // positions of the scores and exponentials of this tasklet
+  const size_t begin = tasklet_id * len / NR_TASKLETS;
+  const size_t end = (tasklet_id + 1) * len / NR_TASKLETS;
 
+  {
     const size_t segment_size = 128;
     const size_t segment_count = HEAD_SIZE / segment_size;
 
-    float *wram_q = mem_alloc(segment_size * sizeof(float));
-    float *wram_kc = mem_alloc(segment_size * sizeof(float));
-    float *wram_att = mem_alloc(chunk_size * sizeof(float));
+    float *wram_q = wram_a;
+    float *wram_kc = wram_b;
 
-    for (size_t i = 0; i < chunk_size; i++) {
-      const size_t t = chunk_offset + i;
-      wram_att[i] = t <= data.pos ? 0.0f : -INFINITY;
+    for (size_t t = begin; t < end; t++) {
+      wram_att[t] = 0.0f;
     }
 
     for (size_t s = 0; s < segment_count; s++) {
       const size_t segment_offset = s * segment_size;
       mram_read(q + segment_offset, wram_q, segment_size * sizeof(float));
 
-      for (size_t i = 0, t = chunk_offset; i < chunk_size && t <= data.pos;
-           i++, t++) {
+      for (size_t t = begin; t < end; t++) {
         mram_read(kc + t * HEAD_SIZE + segment_offset, wram_kc,
                   segment_size * sizeof(float));
-        wram_att[i] += dot(wram_q, wram_kc, segment_size);
+        wram_att[t] += dot(wram_q, wram_kc, segment_size);
       }
     }
 
-    for (size_t i = 0; i < chunk_size; i++) {
-      wram_att[i] /= data.scale;
+    float max = -INFINITY;
+    for (size_t t = begin; t < end; t++) {
+      wram_att[t] /= data.scale;
+      if (wram_att[t] > max) {
+        max = wram_att[t];
+      }
     }
+    partial_max[tasklet_id] = max;
+  }
+
+  // the softmax is left unnormalized, the tasklets reduce max and sum of
+  // their positions in parallel
+  barrier_wait(&max_barrier);
 
-    mram_write(wram_att, att + chunk_offset, chunk_size * sizeof(float));
+  float max = partial_max[0];
+  for (size_t j = 1; j < NR_TASKLETS; j++) {
+    if (partial_max[j] > max) {
+      max = partial_max[j];
+    }
   }
+  float sum = 0.0f;
+  for (size_t t = begin; t < end; t++) {
+    wram_att[t] = expf(wram_att[t] - max);
+    sum += wram_att[t];
+  }
+  partial_sum[tasklet_id] = sum;
 
-  barrier_wait(&softmax_barrier);
+  barrier_wait(&sum_barrier);
 
   if (tasklet_id == 0) {
-    mem_reset();
-    softmax();
-    mem_reset();
+    sum = 0.0f;
+    for (size_t j = 0; j < NR_TASKLETS; j++) {
+      sum += partial_sum[j];
+    }
+    __dma_aligned float stats[2] = {max, sum};
+    mram_write(stats, &partial, sizeof(stats));
   }
 
-  barrier_wait(&softmax_done_barrier);
-
   {
     const size_t chunk_size = chunk_size_for_tasklet(HEAD_SIZE, tasklet_id);
     const size_t chunk_offset = chunk_offset_for_tasklet(HEAD_SIZE, tasklet_id);
@@ -125,17 +137,14 @@ int main(void) {
     const size_t segment_count =
         chunk_size / segment_size + (chunk_size % segment_size != 0);
 
+    // rows of vc are only read up to len, rounded up to the 8 byte
+    // granularity of mram reads
     const size_t vc_segment_size = 64;
-    const size_t vc_segment_count = SEQ_LEN / vc_segment_size;
-
-    // printf("[%i] %i %i - %i %i\n", tasklet_id, chunk_size, chunk_offset,
-    //        segment_size, segment_count);
-
-    float *wram_vc = mem_alloc(vc_segment_size * sizeof(float));
-    float *wram_x = mem_alloc(segment_size * sizeof(float));
-    float *wram_att = mem_alloc(SEQ_LEN * sizeof(float));
+    const size_t vc_segment_count =
+        len / vc_segment_size + (len % vc_segment_size != 0);
 
-    mram_read(att, wram_att, SEQ_LEN * sizeof(float));
+    float *wram_vc = wram_b;
+    float *wram_x = wram_a;
 
     for (size_t s = 0; s < segment_count; s++) {
       const size_t segment_offset = s * segment_size;
@@ -148,11 +157,13 @@ int main(void) {
         wram_x[i] = 0.0f;
         for (size_t k = 0; k < vc_segment_count; k++) {
           const size_t vc_segment_offset = k * vc_segment_size;
-          mram_read(vc + (chunk_offset + segment_offset + i) * SEQ_LEN +
+          const size_t n = len - vc_segment_offset < vc_segment_size
+                               ? len - vc_segment_offset
+                               : vc_segment_size;
+          mram_read(vc + (chunk_offset + segment_offset + i) * SHARD_LEN +
                         vc_segment_offset,
-                    wram_vc, vc_segment_size * sizeof(float));
-          wram_x[i] +=
-              dot(wram_att + vc_segment_offset, wram_vc, vc_segment_size);
+                    wram_vc, ((n + 1) & ~1u) * sizeof(float));
+          wram_x[i] += dot(wram_att + vc_segment_offset, wram_vc, n);
         }
       }
 
@@ -1,12 +1,68 @@
-#define DIM 288
-#define HIDDEN_DIM 768
-#define KV_DIM 288
-#define KV_MUL 1
-#define N_LAYERS 6
-#define N_HEADS 6
-#define N_KV_HEADS 6
-#define HEAD_SIZE 48
-#define VOCAB_SIZE 32000
-#define SEQ_LEN 256
-#define QKV_TASKLETS 8
-#define CLS_ROWS_PER_THREAD 100
+#pragma once
+
+#include <stdint.h>
+
+// model dimensions, derived from the checkpoint header by the host and
+// written into the mram of every kernel once at startup
+typedef struct {
+  uint32_t dim;
+  uint32_t hidden_dim;
+  uint32_t n_layers;
+  uint32_t n_heads;
+  uint32_t n_kv_heads; // heads of k and v, n_heads is a multiple of it
+  uint32_t head_size;
+  uint32_t seq_len;
+  uint32_t rows;       // rows of the stage's weight matrices on each dpu
+  uint32_t cols;       // and their columns, the length of its input
+  uint32_t group_size; // weights per scale of q8 weights, 0 for float
+  uint32_t dpu;        // index of the dpu in its set
+  uint32_t padding;
+} ModelConfig;
+
+// mram capacity of the kernels, the host rejects checkpoints exceeding it
+#define MAX_DIM 1024
+#define MAX_HIDDEN_DIM 4096
+#define MAX_N_LAYERS 16
+#define MAX_HEAD_SIZE 128
+#define MAX_SEQ_LEN 1024
+
+// q8 weights have a float scale per group of at least Q8_MIN_GROUP_SIZE
+// weights, plus one for padding
+#define Q8_MIN_GROUP_SIZE 32
+#define MAX_SCALES(n) ((n) / Q8_MIN_GROUP_SIZE + 1)
+
+// sequences advanced per launch. the shared input vectors of a batch have to
+// fit BATCH_WRAM_BUDGET bytes, enough for a single q8 vector of MAX_HIDDEN_DIM,
+// and the kv caches of all sequences KV_CACHE_SIZE floats each. the host
+// derives the actual limit from both.
+#define MAX_BATCH 16
+#define BATCH_WRAM_BUDGET (21 * 1024)
+#define KV_CACHE_SIZE (6 * 1024 * 1024)
+
+// rows of a stage's matrices on one dpu (config.rows), bounded by mram. the
+// host picks an even count per stage from the dpus available, the tasklets
+// take pairs of rows.
+#define QKV_MAX_ROWS 128
+#define ATTOUT_MAX_ROWS 256
+#define FFN1_MAX_ROWS 256
+#define FFN2_MAX_ROWS 128
+#define CLS_MAX_ROWS 8192
+// fewer rows would leave tasklets of a dpu without a pair
+#define MIN_ROWS_PER_DPU 32
+
+// launch arguments of the kernels, at the start of the block the host writes
+// per launch. see kernels/gemv.c and kernels/mha.c.
+typedef struct {
+  uint32_t layer; // of the group, which selects the resident weights
+  uint32_t batch;
+  uint32_t pos[MAX_BATCH]; // position of every token, only read by RoPE
+} GemvArgs;
+
+typedef struct {
+  float scale;
+  uint32_t layer;
+  uint32_t batch;
+  uint32_t kv_only;         // only insert k and v, for tokens without logits
+  uint32_t pos[MAX_BATCH];  // position of every token
+  uint32_t slot[MAX_BATCH]; // kv cache slot of its sequence
+} MhaArgs;
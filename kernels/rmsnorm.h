@@ -0,0 +1,59 @@
+#pragma once
+
+#include <alloc.h>
+#include <barrier.h>
+#include <defs.h>
+#include <mram.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fast_math.h"
+#include "model_config.h"
+
+// rmsnorm for the kernels consuming its output: every tasklet normalizes a
+// slice of x and the sum of squares is reduced through wram, so all tasklets
+// of the dpu have to call it
+
+BARRIER_INIT(rmsnorm_barrier, NR_TASKLETS);
+static float rmsnorm_partial[MAX_BATCH][NR_TASKLETS];
+
+// o = w * x / rms(x) for each of the batch vectors of n floats in x, o is a
+// wram buffer shared by all tasklets. n has to split into an even number of
+// floats per tasklet.
+static void rmsnorm(float *o, __mram_ptr float *x, __mram_ptr float *w,
+                    size_t n, size_t batch) {
+  const size_t tasklet_id = me();
+  const size_t chunk_size = n / NR_TASKLETS;
+  const size_t chunk_start = tasklet_id * chunk_size;
+
+  float *wram_w = mem_alloc(chunk_size * sizeof(float));
+  mram_read(w + chunk_start, wram_w, chunk_size * sizeof(float));
+
+  // partial reduction
+  for (size_t b = 0; b < batch; b++) {
+    float *ob = o + b * n + chunk_start;
+    mram_read(x + b * n + chunk_start, ob, chunk_size * sizeof(float));
+    float ss = 0.0f;
+    for (size_t i = 0; i < chunk_size; i++) {
+      ss += ob[i] * ob[i];
+    }
+    rmsnorm_partial[b][tasklet_id] = ss;
+  }
+  barrier_wait(&rmsnorm_barrier);
+
+  // final reduction, done redundantly by every tasklet
+  for (size_t b = 0; b < batch; b++) {
+    float ss = 0.0f;
+    for (size_t t = 0; t < NR_TASKLETS; t++) {
+      ss += rmsnorm_partial[b][t];
+    }
+    ss = fast_rsqrtf(ss / n + 1e-5f);
+
+    float *ob = o + b * n + chunk_start;
+    for (size_t i = 0; i < chunk_size; i++) {
+      ob[i] *= wram_w[i] * ss;
+    }
+  }
+  barrier_wait(&rmsnorm_barrier);
+}
@@ -20,6 +20,23 @@ float *forward(Transformer *transformer, int token, int pos) {
   }
 }
 
+void forward_kv(Transformer *transformer, int token, int pos) {
+  if (transformer->use_upmem) {
+    forward_kv_upmem(transformer, token, pos);
+  } else {
+    forward_kv_cpu(transformer, token, pos);
+  }
+}
+
+float *forward_prefill(Transformer *transformer, const int *tokens,
+                       int n_tokens, int pos) {
+  if (transformer->use_upmem) {
+    return forward_prefill_upmem(transformer, tokens, n_tokens, pos);
+  } else {
+    return forward_prefill_cpu(transformer, tokens, n_tokens, pos);
+  }
+}
+
 void print_vector(float *vec, int size) {
   printf("(");
   for (int i = 0; i < size; i++) {
@@ -44,11 +61,11 @@ bool compare_vector(const char *name, float *a, float *b, size_t size) {
 void malloc_run_state(RunState *s, Config *p) {
   // we calloc instead of malloc to keep valgrind happy
   int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+  int head_size = p->dim / p->n_heads;
   s->x = (float *)calloc(p->dim, sizeof(float));
   s->xb = (float *)calloc(p->dim, sizeof(float));
   s->xb2 = (float *)calloc(p->dim, sizeof(float));
   s->hb = (float *)calloc(p->hidden_dim, sizeof(float));
-  s->hb2 = (float *)calloc(p->hidden_dim, sizeof(float));
   s->q = (float *)calloc(p->dim, sizeof(float));
   s->key_cache =
       (float *)calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
@@ -56,12 +73,23 @@ void malloc_run_state(RunState *s, Config *p) {
       (float *)calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
   s->att = (float *)calloc(p->n_heads * p->seq_len, sizeof(float));
   s->logits = (float *)calloc(p->vocab_size, sizeof(float));
+  s->rope = (float *)calloc(p->seq_len * head_size, sizeof(float));
   // ensure all mallocs went fine
-  if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q ||
-      !s->key_cache || !s->value_cache || !s->att || !s->logits) {
+  if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->q || !s->key_cache ||
+      !s->value_cache || !s->att || !s->logits || !s->rope) {
     fprintf(stderr, "malloc failed!\n");
     exit(EXIT_FAILURE);
   }
+
+  // RoPE only depends on the position and the pair's index in the head
+  for (uint32_t pos = 0; pos < p->seq_len; pos++) {
+    for (int head_dim = 0; head_dim < head_size; head_dim += 2) {
+      float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
+      float val = pos * freq;
+      s->rope[pos * head_size + head_dim] = cosf(val);
+      s->rope[pos * head_size + head_dim + 1] = sinf(val);
+    }
+  }
 }
 
 void free_run_state(RunState *s) {
@@ -69,10 +97,10 @@ void free_run_state(RunState *s) {
   free(s->xb);
   free(s->xb2);
   free(s->hb);
-  free(s->hb2);
   free(s->q);
   free(s->att);
   free(s->logits);
+  free(s->rope);
   free(s->key_cache);
   free(s->value_cache);
 }
@@ -112,21 +140,104 @@ void memory_map_weights(TransformerWeights *w, Config *p, float *ptr,
   w->wcls = shared_weights ? w->token_embedding_table : ptr;
 }
 
+// q8 checkpoints are version 2 of llama2.c's export.py: a 256 byte header,
+// the rmsnorm weights in float, then every other tensor (per layer) as int8
+// values followed by one float scale per group
+#define Q8_MAGIC 0x616b3432 // "ak42"
+#define Q8_HEADER_SIZE 256
+
+char *dequantize_tensors(float *x, char *ptr, int n, size_t size,
+                         int group_size) {
+  for (int i = 0; i < n; i++) {
+    int8_t *q = (int8_t *)ptr;
+    ptr += size;
+    float *s = (float *)ptr;
+    ptr += size / group_size * sizeof(float);
+    dequantize(x + i * size, q, s, size, group_size);
+  }
+  return ptr;
+}
+
+// the weights of q8 checkpoints are dequantized into a buffer with the float
+// layout, so every float code path works unchanged
+float *dequantize_weights(TransformerWeights *w, Config *p, char *ptr,
+                          int shared_weights, int group_size) {
+  int head_size = p->dim / p->n_heads;
+  unsigned long long n_layers = p->n_layers;
+  size_t dim = p->dim;
+  size_t kv_dim = p->n_kv_heads * head_size;
+  size_t hidden_dim = p->hidden_dim;
+  size_t embedding_size = p->vocab_size * dim;
+  size_t size = embedding_size * (shared_weights ? 1 : 2) +
+                n_layers * (2 * dim + 2 * dim * dim + 2 * dim * kv_dim +
+                            3 * dim * hidden_dim) +
+                dim + p->seq_len * head_size;
+  float *buffer = malloc(size * sizeof(float));
+  if (!buffer) {
+    fprintf(stderr, "malloc failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  memory_map_weights(w, p, buffer, shared_weights);
+
+  memcpy(w->rms_att_weight, ptr, n_layers * dim * sizeof(float));
+  ptr += n_layers * dim * sizeof(float);
+  memcpy(w->rms_ffn_weight, ptr, n_layers * dim * sizeof(float));
+  ptr += n_layers * dim * sizeof(float);
+  memcpy(w->rms_final_weight, ptr, dim * sizeof(float));
+  ptr += dim * sizeof(float);
+
+  ptr = dequantize_tensors(w->token_embedding_table, ptr, 1, embedding_size,
+                           group_size);
+  ptr = dequantize_tensors(w->wq, ptr, n_layers, dim * dim, group_size);
+  ptr = dequantize_tensors(w->wk, ptr, n_layers, dim * kv_dim, group_size);
+  ptr = dequantize_tensors(w->wv, ptr, n_layers, dim * kv_dim, group_size);
+  ptr = dequantize_tensors(w->wo, ptr, n_layers, dim * dim, group_size);
+  ptr = dequantize_tensors(w->w1, ptr, n_layers, dim * hidden_dim, group_size);
+  ptr = dequantize_tensors(w->w2, ptr, n_layers, dim * hidden_dim, group_size);
+  ptr = dequantize_tensors(w->w3, ptr, n_layers, dim * hidden_dim, group_size);
+  if (!shared_weights) {
+    dequantize_tensors(w->wcls, ptr, 1, embedding_size, group_size);
+  }
+  return buffer;
+}
+
 void read_checkpoint(char *checkpoint, Config *config,
                      TransformerWeights *weights, int *fd, float **data,
-                     size_t *file_size) {
+                     size_t *file_size, float **dequantized,
+                     int *group_size) {
   FILE *file = fopen(checkpoint, "rb");
   if (!file) {
     fprintf(stderr, "Couldn't open file %s\n", checkpoint);
     exit(EXIT_FAILURE);
   }
   // read in the config header
-  if (fread(config, sizeof(Config), 1, file) != 1) {
+  uint32_t magic = 0;
+  if (fread(&magic, sizeof(magic), 1, file) != 1) {
     exit(EXIT_FAILURE);
   }
-  // negative vocab size is hacky way of signaling unshared weights. bit yikes.
-  int shared_weights = config->vocab_size > 0 ? 1 : 0;
-  config->vocab_size = abs(config->vocab_size);
+  int shared_weights;
+  *group_size = 0;
+  if (magic == Q8_MAGIC) {
+    int version = 0;
+    uint8_t shared_classifier = 0;
+    if (fread(&version, sizeof(int), 1, file) != 1 || version != 2 ||
+        fread(config, sizeof(Config), 1, file) != 1 ||
+        fread(&shared_classifier, sizeof(uint8_t), 1, file) != 1 ||
+        fread(group_size, sizeof(int), 1, file) != 1) {
+      fprintf(stderr, "unsupported q8 checkpoint %s\n", checkpoint);
+      exit(EXIT_FAILURE);
+    }
+    shared_weights = shared_classifier;
+  } else {
+    rewind(file);
+    if (fread(config, sizeof(Config), 1, file) != 1) {
+      exit(EXIT_FAILURE);
+    }
+    // negative vocab size is hacky way of signaling unshared weights. bit
+    // yikes.
+    shared_weights = config->vocab_size > 0 ? 1 : 0;
+    config->vocab_size = abs(config->vocab_size);
+  }
 
   // figure out the file size
   fseek(file, 0, SEEK_END); // move file pointer to end of file
@@ -143,14 +254,85 @@ void read_checkpoint(char *checkpoint, Config *config,
     fprintf(stderr, "mmap failed!\n");
     exit(EXIT_FAILURE);
   }
-  float *weights_ptr = *data + sizeof(Config) / sizeof(float);
-  memory_map_weights(weights, config, weights_ptr, shared_weights);
+  *dequantized = NULL;
+  if (*group_size > 0) {
+    *dequantized =
+        dequantize_weights(weights, config, (char *)*data + Q8_HEADER_SIZE,
+                           shared_weights, *group_size);
+  } else {
+    float *weights_ptr = *data + sizeof(Config) / sizeof(float);
+    memory_map_weights(weights, config, weights_ptr, shared_weights);
+  }
+}
+
+void quantize_tensors(FILE *file, float *x, int n, size_t size,
+                      int group_size) {
+  int8_t *q = malloc(size);
+  float *s = malloc(size / group_size * sizeof(float));
+  for (int i = 0; i < n; i++) {
+    quantize(q, s, x + i * size, size, group_size);
+    fwrite(q, 1, size, file);
+    fwrite(s, sizeof(float), size / group_size, file);
+  }
+  free(q);
+  free(s);
+}
+
+// writes the model as a q8 checkpoint, readable by read_checkpoint() and
+// llama2.c's runq
+void export_q8(Transformer *t, const char *path) {
+  Config *p = &t->config;
+  TransformerWeights *w = &t->weights;
+  int group_size = t->group_size > 0 ? t->group_size : default_group_size(p);
+  size_t dim = p->dim;
+  size_t kv_dim = p->n_kv_heads * (dim / p->n_heads);
+  size_t hidden_dim = p->hidden_dim;
+  size_t embedding_size = p->vocab_size * dim;
+  unsigned long long n_layers = p->n_layers;
+  uint8_t shared_classifier = w->wcls == w->token_embedding_table;
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "couldn't open %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  uint32_t magic = Q8_MAGIC;
+  int version = 2;
+  fwrite(&magic, sizeof(magic), 1, file);
+  fwrite(&version, sizeof(version), 1, file);
+  fwrite(p, sizeof(Config), 1, file);
+  fwrite(&shared_classifier, sizeof(shared_classifier), 1, file);
+  fwrite(&group_size, sizeof(group_size), 1, file);
+  while (ftell(file) < Q8_HEADER_SIZE) {
+    fputc(0, file);
+  }
+
+  fwrite(w->rms_att_weight, sizeof(float), n_layers * dim, file);
+  fwrite(w->rms_ffn_weight, sizeof(float), n_layers * dim, file);
+  fwrite(w->rms_final_weight, sizeof(float), dim, file);
+
+  quantize_tensors(file, w->token_embedding_table, 1, embedding_size,
+                   group_size);
+  quantize_tensors(file, w->wq, n_layers, dim * dim, group_size);
+  quantize_tensors(file, w->wk, n_layers, dim * kv_dim, group_size);
+  quantize_tensors(file, w->wv, n_layers, dim * kv_dim, group_size);
+  quantize_tensors(file, w->wo, n_layers, dim * dim, group_size);
+  quantize_tensors(file, w->w1, n_layers, dim * hidden_dim, group_size);
+  quantize_tensors(file, w->w2, n_layers, dim * hidden_dim, group_size);
+  quantize_tensors(file, w->w3, n_layers, dim * hidden_dim, group_size);
+  if (!shared_classifier) {
+    quantize_tensors(file, w->wcls, 1, embedding_size, group_size);
+  }
+  if (fclose(file) != 0) {
+    fprintf(stderr, "couldn't write %s\n", path);
+    exit(EXIT_FAILURE);
+  }
 }
 
 void build_transformer(Transformer *t, char *checkpoint_path) {
   // read in the Config and the Weights from the checkpoint
   read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data,
-                  &t->file_size);
+                  &t->file_size, &t->dequantized, &t->group_size);
   // allocate the RunState buffers
   malloc_run_state(&t->state, &t->config);
 }
@@ -163,8 +345,10 @@ void free_transformer(Transformer *t) {
   if (t->fd != -1) {
     close(t->fd);
   }
+  free(t->dequantized);
   // free the RunState buffers
   free_run_state(&t->state);
+  free_cpu();
 }
 
 // ----------------------------------------------------------------------------
@@ -569,38 +753,63 @@ int sample(Sampler *sampler, float *logits) {
 // ----------------------------------------------------------------------------
 // utilities: time
 
-double time_in_ms() { return clock() / (CLOCKS_PER_SEC * 1000.0); }
+double time_in_ms() {
+  // return wall time in milliseconds, for benchmarking the model speed
+  struct timespec time;
+  timespec_get(&time, TIME_UTC);
+  return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
 
 // ----------------------------------------------------------------------------
 // generation loop
 
-void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
-              const char *prompt, int steps) {
+// the tokens of the prompt after a BOS, an empty prompt for NULL. the caller
+// frees them.
+int *encode_prompt(Tokenizer *tokenizer, const char *prompt,
+                   int *num_prompt_tokens) {
   const char *empty_prompt = "";
   if (prompt == NULL) {
     prompt = empty_prompt;
   }
 
-  // encode the (string) prompt into tokens sequence
-  int num_prompt_tokens = 0;
   int *prompt_tokens = (int *)malloc((strlen(prompt) + 3) *
                                      sizeof(int)); // +3 for '\0', ?BOS, ?EOS
-  encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
-  if (num_prompt_tokens < 1) {
+  encode(tokenizer, prompt, 1, 0, prompt_tokens, num_prompt_tokens);
+  if (*num_prompt_tokens < 1) {
     fprintf(stderr, "something is wrong, expected at least 1 prompt token\n");
     exit(EXIT_FAILURE);
   }
+  return prompt_tokens;
+}
+
+void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
+              const char *prompt, int steps) {
+  // encode the (string) prompt into tokens sequence
+  int num_prompt_tokens = 0;
+  int *prompt_tokens = encode_prompt(tokenizer, prompt, &num_prompt_tokens);
 
   // start the main loop
-  long start =
+  double start =
       0;    // used to time our code, only initialized after first iteration
   int next; // will store the next token in the sequence
   int token = prompt_tokens[0]; // kick off with the first token in the prompt
   int pos = 0;                  // position in the sequence
+  float *logits = NULL;
+  int generated = 0; // tokens forwarded after the prompt
+  double time_to_first_token = 0;
   while (pos < steps) {
 
-    // forward the transformer to get logits for the next token
-    float *logits = forward(transformer, token, pos);
+    // forward the transformer to get logits for the next token. the prompt
+    // goes through in one pass, which yields the logits after its last token
+    if (pos == 0) {
+      int n = num_prompt_tokens < steps ? num_prompt_tokens : steps;
+      double prefill_start = time_in_ms();
+      logits = forward_prefill(transformer, prompt_tokens, n, 0);
+      time_to_first_token = time_in_ms() - prefill_start;
+    } else if (pos >= num_prompt_tokens) {
+      logits = forward(transformer, token, pos);
+      generated++;
+    }
 
     // advance the state machine
     if (pos < num_prompt_tokens - 1) {
@@ -632,12 +841,17 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
   }
   printf("\n");
 
-  // report achieved tok/s (pos-1 because the timer starts after first
-  // iteration)
-  if (pos > 1) {
-    long end = time_in_ms();
-    fprintf(stderr, "achieved tok/s: %f\n",
-            (pos - 1) / (double)(end - start) * 1000);
+  fprintf(stderr, "time to first token: %f ms (%d prompt tokens)\n",
+          time_to_first_token, num_prompt_tokens);
+  // report achieved tok/s of the tokens after the prompt
+  if (generated > 0) {
+    double end = time_in_ms();
+    fprintf(stderr, "achieved tok/s: %f\n", generated / (end - start) * 1000);
+  }
+  if (transformer->use_upmem) {
+    print_upmem_stats();
+  } else {
+    fprintf(stderr, "cpu matmul: %s\n", matmul_isa());
   }
 
   free(prompt_tokens);
@@ -717,22 +931,34 @@ void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
       printf("Assistant: ");
     }
 
-    // determine the token to pass into the transformer next
+    // determine the token to pass into the transformer next and forward the
+    // transformer to get logits for the next token
+    float *logits;
     if (user_idx < num_prompt_tokens) {
-      // if we are still processing the input prompt, force the next prompt
-      // token
-      token = prompt_tokens[user_idx++];
+      // if we are still processing the input prompt, it goes through in one
+      // pass
+      int n = num_prompt_tokens - user_idx;
+      if (n > steps - pos) {
+        n = steps - pos;
+      }
+      logits = forward_prefill(transformer, prompt_tokens + user_idx, n, pos);
+      token = prompt_tokens[user_idx + n - 1];
+      user_idx += n;
+      pos += n - 1;
+    } else if (next == 2) {
+      // EOS (=2) token ends the Assistant turn. the user prompt comes next,
+      // so the logits after it aren't needed
+      token = next;
+      forward_kv(transformer, token, pos);
+      user_turn = 1;
+      pos++;
+      continue;
     } else {
       // otherwise use the next token sampled from previous turn
       token = next;
-    }
-    // EOS (=2) token ends the Assistant turn
-    if (token == 2) {
-      user_turn = 1;
+      logits = forward(transformer, token, pos);
     }
 
-    // forward the transformer to get logits for the next token
-    float *logits = forward(transformer, token, pos);
     next = sample(sampler, logits);
     pos++;
 
@@ -751,6 +977,330 @@ void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
   free(prompt_tokens);
 }
 
+// ----------------------------------------------------------------------------
+// accuracy of the upmem backend, or with -c of the q8 path of the cpu backend.
+// forward_cpu on the float weights serves as the reference
+
+void compare_backends(Transformer *transformer, Tokenizer *tokenizer,
+                      const char *prompt, int steps) {
+  int num_prompt_tokens = 0;
+  int *prompt_tokens = encode_prompt(tokenizer, prompt, &num_prompt_tokens);
+
+  // the q8 path runs on the same backend, so it keeps a kv cache of its own
+  bool cpu_q8 = transformer->cpu_q8 && !transformer->use_upmem;
+  const char *name = cpu_q8 ? "cpu q8" : "upmem";
+  RunState reference_state = transformer->state;
+  RunState q8_state;
+  if (cpu_q8) {
+    malloc_run_state(&q8_state, &transformer->config);
+  }
+
+  int vocab_size = transformer->config.vocab_size;
+  float *reference = malloc(vocab_size * sizeof(float));
+  float max_diff = 0.0f;
+  double kl = 0.0, nll_cpu = 0.0, nll_compared = 0.0;
+  int agree = 0;
+
+  // the sequence follows the prompt, then the greedy choice of the reference
+  int token = prompt_tokens[0];
+  for (int pos = 0; pos < steps; pos++) {
+    transformer->cpu_q8 = false;
+    memcpy(reference, forward_cpu(transformer, token, pos),
+           vocab_size * sizeof(float));
+    float *logits;
+    if (cpu_q8) {
+      transformer->cpu_q8 = true;
+      transformer->state = q8_state;
+      logits = forward_cpu(transformer, token, pos);
+      transformer->state = reference_state;
+    } else {
+      logits = forward_upmem(transformer, token, pos);
+    }
+
+    int next = sample_argmax(reference, vocab_size);
+    agree += sample_argmax(logits, vocab_size) == next;
+    if (pos < num_prompt_tokens - 1) {
+      next = prompt_tokens[pos + 1];
+    }
+
+    for (int i = 0; i < vocab_size; i++) {
+      max_diff = fmaxf(max_diff, fabsf(reference[i] - logits[i]));
+    }
+    softmax(reference, vocab_size);
+    softmax(logits, vocab_size);
+    for (int i = 0; i < vocab_size; i++) {
+      if (reference[i] > 0.0f) {
+        kl += reference[i] * logf(reference[i] / fmaxf(logits[i], 1e-30f));
+      }
+    }
+    nll_cpu -= logf(reference[next]);
+    nll_compared -= logf(fmaxf(logits[next], 1e-30f));
+    token = next;
+  }
+
+  if (cpu_q8) {
+    size_t q8_bytes = cpu_weight_bytes(transformer);
+    transformer->cpu_q8 = false;
+    size_t float_bytes = cpu_weight_bytes(transformer);
+    transformer->cpu_q8 = true;
+    printf("compared %d positions, weights read per token: float %.1f MB, "
+           "q8 %.1f MB (%.2fx less)\n",
+           steps, float_bytes / 1e6, q8_bytes / 1e6,
+           (double)float_bytes / q8_bytes);
+  } else {
+    printf("compared %d positions, %s weights on the dpus\n", steps,
+           transformer->upmem_q8 || transformer->group_size > 0 ? "q8"
+                                                                : "float");
+  }
+  printf("max |logit difference|: %f\n", max_diff);
+  printf("argmax agreement: %.1f%%\n", 100.0 * agree / steps);
+  printf("mean kl(cpu || %s): %g\n", name, kl / steps);
+  printf("perplexity: cpu %f, %s %f\n", exp(nll_cpu / steps), name,
+         exp(nll_compared / steps));
+  if (cpu_q8) {
+    free_run_state(&q8_state);
+  } else {
+    print_upmem_stats();
+  }
+
+  free(reference);
+  free(prompt_tokens);
+}
+
+// ----------------------------------------------------------------------------
+// throughput of batched decoding on the upmem backend
+
+void benchmark_batch(Transformer *transformer, Tokenizer *tokenizer,
+                     Sampler *sampler, const char *prompt, int steps) {
+  int num_prompt_tokens = 0;
+  int *prompt_tokens = encode_prompt(tokenizer, prompt, &num_prompt_tokens);
+
+  int vocab_size = transformer->config.vocab_size;
+  int max_batch = upmem_max_batch(transformer);
+  int *tokens = malloc(max_batch * sizeof(int));
+  int *pos = malloc(max_batch * sizeof(int));
+
+  // the first call allocates the dpus and loads the weights
+  int zero = 0;
+  forward_upmem_batch(transformer, prompt_tokens, &zero, 1);
+
+  // every sequence starts from the prompt and then samples on its own
+  printf("batch      tok/s    ms/step  speedup\n");
+  double base = 0.0;
+  for (int batch = 1; batch <= max_batch; batch++) {
+    for (int b = 0; b < batch; b++) {
+      tokens[b] = prompt_tokens[0];
+    }
+
+    double start = time_in_ms();
+    for (int p = 0; p < steps; p++) {
+      for (int b = 0; b < batch; b++) {
+        pos[b] = p;
+      }
+      float *logits = forward_upmem_batch(transformer, tokens, pos, batch);
+      for (int b = 0; b < batch; b++) {
+        tokens[b] = p < num_prompt_tokens - 1
+                        ? prompt_tokens[p + 1]
+                        : sample(sampler, logits + b * vocab_size);
+      }
+    }
+    double elapsed = time_in_ms() - start;
+
+    double tok_s = batch * steps / (elapsed / 1000.0);
+    if (batch == 1) {
+      base = tok_s;
+    }
+    printf("%5d %10.2f %10.3f %7.2fx\n", batch, tok_s, elapsed / steps,
+           tok_s / base);
+  }
+  print_upmem_stats();
+
+  free(tokens);
+  free(pos);
+  free(prompt_tokens);
+}
+
+// ----------------------------------------------------------------------------
+// decoding speed of the upmem backend over the ranks its partition may use
+
+// greedy decoding of steps tokens after the prompt with forward, timed from
+// the second token on so that the first one can set up the backend
+double decode_tok_s(Transformer *transformer,
+                    float *(*forward)(Transformer *, int, int),
+                    const int *prompt_tokens, int num_prompt_tokens,
+                    int steps) {
+  int token = prompt_tokens[0];
+  forward(transformer, token, 0);
+
+  double start = time_in_ms();
+  for (int pos = 1; pos < steps; pos++) {
+    float *logits = forward(transformer, token, pos);
+    token = pos < num_prompt_tokens
+                ? prompt_tokens[pos]
+                : sample_argmax(logits, transformer->config.vocab_size);
+  }
+  double elapsed = time_in_ms() - start;
+  return (steps - 1) / (elapsed / 1000.0);
+}
+
+void benchmark_scaling(Transformer *transformer, Tokenizer *tokenizer,
+                       const char *prompt, int steps) {
+  int num_prompt_tokens = 0;
+  int *prompt_tokens = encode_prompt(tokenizer, prompt, &num_prompt_tokens);
+
+  int required, available;
+  upmem_rank_range(transformer, &required, &available);
+  if (required == 0) {
+    fprintf(stderr, "model needs more than the %d ranks available\n",
+            available);
+    exit(EXIT_FAILURE);
+  }
+
+  // every stage has its own dpu set and sets are allocated in whole ranks,
+  // so the sweep starts at the fewest ranks the model fits in and doubles
+  printf("ranks  dpus      tok/s  speedup\n");
+  double base = 0.0;
+  for (int ranks = required;;) {
+    transformer->upmem_ranks = ranks;
+    free_upmem();
+
+    // the first token allocates the dpus and loads the weights
+    double tok_s = decode_tok_s(transformer, forward_upmem, prompt_tokens,
+                                num_prompt_tokens, steps);
+    if (ranks == required) {
+      base = tok_s;
+    }
+    printf("%5d %5d %10.2f %7.2fx\n", ranks, upmem_nr_dpus(), tok_s,
+           tok_s / base);
+
+    if (ranks == available) {
+      break;
+    }
+    ranks = ranks * 2 < available ? ranks * 2 : available;
+  }
+  print_upmem_stats();
+
+  free(prompt_tokens);
+}
+
+// ----------------------------------------------------------------------------
+// decoding speed of the cpu backend over the threads of its pool
+
+void benchmark_threads(Transformer *transformer, Tokenizer *tokenizer,
+                       const char *prompt, int steps) {
+  int num_prompt_tokens = 0;
+  int *prompt_tokens = encode_prompt(tokenizer, prompt, &num_prompt_tokens);
+
+  // the thread count doubles up to one thread per online core
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    cores = 1;
+  }
+  printf("threads      tok/s  speedup\n");
+  double base = 0.0;
+  for (int threads = 1;;) {
+    transformer->cpu_threads = threads;
+
+    // the first token starts the pool
+    double tok_s = decode_tok_s(transformer, forward_cpu, prompt_tokens,
+                                num_prompt_tokens, steps);
+    if (threads == 1) {
+      base = tok_s;
+    }
+    printf("%7d %10.2f %7.2fx\n", threads, tok_s, tok_s / base);
+
+    if (threads == cores) {
+      break;
+    }
+    threads = threads * 2 < cores ? threads * 2 : cores;
+  }
+  printf("cpu matmul: %s\n", matmul_isa());
+
+  free(prompt_tokens);
+}
+
+// ----------------------------------------------------------------------------
+// throughput of layer-pipelined decoding over the number of layer groups
+
+void benchmark_pipeline(Transformer *transformer, Tokenizer *tokenizer,
+                        Sampler *sampler, const char *prompt, int steps) {
+  int num_prompt_tokens = 0;
+  int *prompt_tokens = encode_prompt(tokenizer, prompt, &num_prompt_tokens);
+
+  int vocab_size = transformer->config.vocab_size;
+  int n_layers = transformer->config.n_layers;
+  int *tokens = malloc(n_layers * MAX_BATCH * sizeof(int));
+  int *pos = malloc(n_layers * MAX_BATCH * sizeof(int));
+
+  // every group keeps a block of sequences in flight, so more groups decode
+  // more sequences at once on more dpus
+  printf("groups  sequences  ranks      tok/s  speedup\n");
+  double base = 0.0;
+  for (int groups = 1; groups <= n_layers; groups++) {
+    if (n_layers % groups != 0) {
+      continue;
+    }
+    // the ranks of the previous plan count as available
+    free_upmem();
+    int required, available;
+    transformer->upmem_groups = groups;
+    upmem_rank_range(transformer, &required, &available);
+    if (required == 0) {
+      break;
+    }
+
+    int batch = upmem_pipeline_batch(transformer);
+    for (int i = 0; i < groups * batch; i++) {
+      tokens[i] = prompt_tokens[0];
+    }
+
+    // block m enters the pipeline on calls m, m + groups, ..., and its logits
+    // come back with the call before its next turn. the first call allocates
+    // the dpus and loads the weights.
+    int decoded = 0;
+    double start = 0.0;
+    for (int call = 0; call < steps * groups; call++) {
+      if (call == 1) {
+        start = time_in_ms();
+      }
+      int block = call % groups;
+      for (int b = 0; b < batch; b++) {
+        pos[block * batch + b] = call / groups;
+      }
+      float *logits =
+          forward_upmem_pipelined(transformer, block, tokens + block * batch,
+                                  pos + block * batch, batch);
+      if (logits == NULL) {
+        continue;
+      }
+      int done = (block + 1) % groups;
+      int next = (call + 1) / groups;
+      for (int b = 0; b < batch; b++) {
+        tokens[done * batch + b] =
+            next < num_prompt_tokens
+                ? prompt_tokens[next]
+                : sample(sampler, logits + b * vocab_size);
+      }
+      if (call > 0) {
+        decoded += batch;
+      }
+    }
+    double elapsed = time_in_ms() - start;
+
+    double tok_s = decoded / (elapsed / 1000.0);
+    if (groups == 1) {
+      base = tok_s;
+    }
+    printf("%6d %10d %6d %10.2f %7.2fx\n", groups, groups * batch, required,
+           tok_s, tok_s / base);
+  }
+  print_upmem_stats();
+
+  free(tokens);
+  free(pos);
+  free(prompt_tokens);
+}
+
 // ----------------------------------------------------------------------------
 // CLI, include only if not testing
 #ifndef TESTING
@@ -767,27 +1317,107 @@ void error_usage() {
                   "max_seq_len\n");
   fprintf(stderr, "  -i <string> input prompt\n");
   fprintf(stderr, "  -z <string> optional path to custom tokenizer\n");
-  fprintf(stderr, "  -m <string> mode: generate|chat, default: generate\n");
+  fprintf(stderr, "  -m <string> mode: generate|chat|compare|batch|scaling|"
+                  "pipeline|threads, default: generate\n");
   fprintf(stderr, "  -y <string> (optional) system prompt in chat mode\n");
+  fprintf(stderr, "  -j <int>    (optional) threads of the cpu backend, "
+                  "default: one per core\n");
+  fprintf(stderr, "  -c (optional) int8 weights and activations on the cpu "
+                  "backend, -m compare checks them against float\n");
+  fprintf(stderr, "  -k (optional) repack the float weights of the cpu "
+                  "backend into panels\n");
   fprintf(stderr, "  -u (optional) use upmem backend\n");
+  fprintf(stderr, "  -a (optional) asynchronous upmem launches and "
+                  "transfers\n");
+  fprintf(stderr, "  -q (optional) group-quantized int8 weights on the upmem "
+                  "backend\n");
+  fprintf(stderr, "  -r <int>    (optional) ranks the upmem backend may use, "
+                  "default: all\n");
+  fprintf(stderr, "  -g <int>    (optional) layer groups on disjoint upmem "
+                  "dpu sets, default: 1\n");
+  fprintf(stderr, "  -e <string> (optional) export a q8 checkpoint and "
+                  "exit\n");
+  fprintf(stderr, "  -b (optional) benchmark the dpu math functions and "
+                  "exit\n");
+  fprintf(stderr, "  -w (optional) benchmark the cpu matvec on row-major and "
+                  "repacked weights and exit\n");
   exit(EXIT_FAILURE);
 }
 
 void benchmark_mha_big() {
-  printf("benchmarking multi-head attention\n");
+  printf("benchmarking multi-head attention over the sequence length\n");
+  printf("seq_len  dpus  ms/call  max error\n");
 
-  // dry run to initialize dpus
-  mha_big_test(4);
-  printf("finished warmup run\n");
+  for (int seq_len = 256; seq_len <= 4096; seq_len *= 2) {
+    int dpus = mha_big_setup(seq_len);
 
-  double start = time_in_ms();
-  for (int i = 0; i < 32; i++) {
-    double s = time_in_ms();
-    mha_big_test(4);
-    printf("%fms\n", time_in_ms() - s);
+    // dry run, checked against the host
+    mha_big_test();
+    float error = mha_big_error();
+
+    double start = time_in_ms();
+    for (int i = 0; i < 32; i++) {
+      mha_big_test();
+    }
+    double end = time_in_ms();
+    printf("%7d %5d %8.3f %10g\n", seq_len, dpus, (end - start) / 32.0,
+           error);
+  }
+}
+
+void benchmark_math() {
+  MathBench results[MATH_BENCH_FUNCTIONS];
+  math_bench(results);
+
+  printf("benchmarking the dpu math functions on one tasklet\n");
+  printf("function  cycles/call  fast cycles/call  speedup  max error\n");
+  for (int f = 0; f < MATH_BENCH_FUNCTIONS; f++) {
+    printf("%-8s %12u %17u %8.2f %10g\n", results[f].name, results[f].cycles,
+           results[f].fast_cycles,
+           (double)results[f].cycles / results[f].fast_cycles,
+           results[f].error);
+  }
+}
+
+void benchmark_gemv() {
+  // wq, w1, w2 and wcls of each model, wq fused with wk and wv and w1 with w3
+  const struct {
+    const char *model;
+    int dim, hidden_dim;
+  } models[] = {{"stories15M", 288, 768}, {"stories110M", 768, 2048}};
+  const int vocab_size = 32000;
+
+  printf("benchmarking the cpu matvec on row-major weights, on panels and "
+         "fused, %s, one thread\n",
+         matmul_isa());
+  printf("model         rows  cols  ms/call  panels ms/call  speedup  GB/s  "
+         "panels GB/s  fused  separate ms  fused ms  speedup  max error\n");
+  for (size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+    const int dim = models[i].dim;
+    const int hidden_dim = models[i].hidden_dim;
+    const int shapes[4][3] = {{dim, dim, 3},
+                              {hidden_dim, dim, 2},
+                              {dim, hidden_dim, 1},
+                              {vocab_size, dim, 1}};
+    for (int s = 0; s < 4; s++) {
+      const int d = shapes[s][0];
+      const int n = shapes[s][1];
+      const int fused = shapes[s][2];
+      GemvBench result;
+      gemv_bench(n, d, fused, &result);
+      const double bytes = (double)d * n * sizeof(float);
+      printf("%-12s %5d %5d %8.4f %15.4f %8.2f %5.1f %12.1f", models[i].model,
+             d, n, result.ms, result.packed_ms, result.ms / result.packed_ms,
+             bytes / result.ms / 1e6, bytes / result.packed_ms / 1e6);
+      if (fused > 1) {
+        printf(" %6d %12.4f %9.4f %8.2f", fused, result.separate_ms,
+               result.fused_ms, result.separate_ms / result.fused_ms);
+      } else {
+        printf(" %6s %12s %9s %8s", "-", "-", "-", "-");
+      }
+      printf(" %10g\n", result.error);
+    }
   }
-  double end = time_in_ms();
-  printf("average: %fms\n", (end - start) / 32.0f);
 }
 
 int main(int argc, char *argv[]) {
@@ -806,7 +1436,15 @@ int main(int argc, char *argv[]) {
   char *system_prompt =
       NULL; // the (optional) system prompt to use in chat mode
   Transformer transformer;
+  transformer.cpu_threads = 0;
+  transformer.cpu_q8 = false;
+  transformer.cpu_packed = false;
   transformer.use_upmem = false;
+  transformer.upmem_async = false;
+  transformer.upmem_q8 = false;
+  transformer.upmem_ranks = 0;
+  transformer.upmem_groups = 1;
+  const char *export_path = NULL; // q8 checkpoint to write
 
   // poor man's C argparse so we can override the defaults above from the
   // command line
@@ -840,11 +1478,33 @@ int main(int argc, char *argv[]) {
       mode = argv[++i];
     } else if (argv[i][1] == 'y') {
       system_prompt = argv[++i];
+    } else if (argv[i][1] == 'c') {
+      transformer.cpu_q8 = true;
+    } else if (argv[i][1] == 'k') {
+      transformer.cpu_packed = true;
+    } else if (argv[i][1] == 'j') {
+      transformer.cpu_threads = atoi(argv[++i]);
     } else if (argv[i][1] == 'u') {
       transformer.use_upmem = true;
+    } else if (argv[i][1] == 'a') {
+      transformer.upmem_async = true;
+    } else if (argv[i][1] == 'q') {
+      transformer.upmem_q8 = true;
+    } else if (argv[i][1] == 'r') {
+      transformer.upmem_ranks = atoi(argv[++i]);
+    } else if (argv[i][1] == 'g') {
+      transformer.upmem_groups = atoi(argv[++i]);
+    } else if (argv[i][1] == 'e') {
+      export_path = argv[++i];
     } else if (argv[i][1] == 'x') {
       benchmark_mha_big();
       exit(0);
+    } else if (argv[i][1] == 'b') {
+      benchmark_math();
+      exit(0);
+    } else if (argv[i][1] == 'w') {
+      benchmark_gemv();
+      exit(0);
     } else {
       error_usage();
     }
@@ -860,6 +1520,11 @@ int main(int argc, char *argv[]) {
 
   // build the Transformer via the model .bin file
   build_transformer(&transformer, checkpoint_path);
+  if (export_path) {
+    export_q8(&transformer, export_path);
+    free_transformer(&transformer);
+    return 0;
+  }
   if (steps == 0 || steps > transformer.config.seq_len)
     steps = transformer.config.seq_len; // override to ~max length
 
@@ -877,6 +1542,16 @@ int main(int argc, char *argv[]) {
     generate(&transformer, &tokenizer, &sampler, prompt, steps);
   } else if (strcmp(mode, "chat") == 0) {
     chat(&transformer, &tokenizer, &sampler, prompt, system_prompt, steps);
+  } else if (strcmp(mode, "compare") == 0) {
+    compare_backends(&transformer, &tokenizer, prompt, steps);
+  } else if (strcmp(mode, "batch") == 0) {
+    benchmark_batch(&transformer, &tokenizer, &sampler, prompt, steps);
+  } else if (strcmp(mode, "scaling") == 0) {
+    benchmark_scaling(&transformer, &tokenizer, prompt, steps);
+  } else if (strcmp(mode, "pipeline") == 0) {
+    benchmark_pipeline(&transformer, &tokenizer, &sampler, prompt, steps);
+  } else if (strcmp(mode, "threads") == 0) {
+    benchmark_threads(&transformer, &tokenizer, prompt, steps);
   } else {
     fprintf(stderr, "unknown mode: %s\n", mode);
     error_usage();
@@ -48,12 +48,14 @@ typedef struct {
   float *xb;     // same, but inside a residual branch (dim,)
   float *xb2;    // an additional buffer just for convenience (dim,)
   float *hb;     // buffer for hidden dimension in the ffn (hidden_dim,)
-  float *hb2;    // buffer for hidden dimension in the ffn (hidden_dim,)
   float *q;      // query (dim,)
   float *k;      // key (dim,)
   float *v;      // value (dim,)
   float *att;    // buffer for scores/attention values (n_heads, seq_len)
   float *logits; // output logits
+  // cos and sin of the RoPE rotation of every position and pair of a head,
+  // built once: (seq_len, head_size)
+  float *rope;
   // kv cache
   float *key_cache;   // (layer, seq_len, dim)
   float *value_cache; // (layer, seq_len, dim)
@@ -67,7 +69,17 @@ typedef struct {
   int fd;           // file descriptor for memory mapping
   float *data;      // memory mapped data pointer
   size_t file_size; // size of the checkpoint file in bytes
+  // q8 checkpoints are dequantized into this buffer at load time
+  float *dequantized;
+  int group_size; // weights per scale of a q8 checkpoint, 0 for float
+  int cpu_threads; // threads of the cpu backend, 0 for one per core
+  bool cpu_q8;     // int8 weights and activations on the cpu backend
+  bool cpu_packed; // float weights of the cpu backend repacked into panels
   bool use_upmem;
+  bool upmem_async; // queue upmem launches and transfers asynchronously
+  bool upmem_q8;    // group-quantized int8 weights on the dpus
+  int upmem_ranks;  // ranks the dpu partition may use, 0 for all
+  int upmem_groups; // layer groups on disjoint dpu sets, see pipelined below
 } Transformer;
 
 // ----------------------------------------------------------------------------
@@ -79,14 +91,136 @@ void softmax(float *x, int size);
 
 void matmul(float *xout, float *x, float *w, int n, int d);
 
+// matmul of a batch of vectors, reading every row of w once
+void matmul_batch(float *xout, float *x, float *w, int n, int d, int batch);
+
+// vector isa of the matmul kernels picked for this cpu at the first matmul:
+// "avx512", "avx2" or "generic"
+const char *matmul_isa(void);
+
+// symmetric int8 quantization with one scale per group of group_size values,
+// n has to be a multiple of group_size
+void quantize(int8_t *q, float *s, const float *x, size_t n, int group_size);
+
+void dequantize(float *x, const int8_t *q, const float *s, size_t n,
+                int group_size);
+
+// largest group size up to 64 dividing the rows of every matrix
+int default_group_size(const Config *p);
+
 float *forward_cpu(Transformer *transformer, int token, int pos);
 
+// stops the worker threads of the cpu backend and drops its int8 weights,
+// the next cpu forward starts transformer->cpu_threads of them again
+void free_cpu(void);
+
+// ms per call of a (d, n) float matvec on one thread of the cpu backend, with
+// row-major weights and with the weights repacked into panels, and the
+// largest difference of their outputs. n has to be a multiple of 16. for
+// fused > 1 (up to 3) also of that many such matrices with the same input,
+// one after the other and fused into one pass over it as for qkv or w1 and
+// w3.
+typedef struct {
+  double ms;
+  double packed_ms;
+  double separate_ms;
+  double fused_ms;
+  float error;
+} GemvBench;
+
+void gemv_bench(int n, int d, int fused, GemvBench *result);
+
+// bytes of weights a cpu forward reads per token, with or without
+// transformer->cpu_q8
+size_t cpu_weight_bytes(const Transformer *transformer);
+
 float *forward_upmem(Transformer *transformer, int token, int pos);
 
+// advances batch independent sequences by one token each and returns their
+// logits (batch, vocab_size). sequence b keeps its kv cache in slot b, so it
+// has to stay at the same index across calls.
+float *forward_upmem_batch(Transformer *transformer, const int *tokens,
+                           const int *pos, int batch);
+
+int upmem_max_batch(const Transformer *transformer);
+
+// layer-pipelined decoding: the layers are split into
+// transformer->upmem_groups groups of consecutive layers on disjoint dpu
+// sets, and a block of sequences is in flight in every group. each call moves
+// every block on by one group, all groups running at the same time: block
+// (0 <= block < upmem_groups) enters the first group with the next token of
+// its sequences, and the logits (batch, vocab_size) of the block leaving the
+// last group are returned, or NULL while the pipeline fills. that is block
+// (block + 1) % upmem_groups, so feeding the blocks in turn keeps every group
+// busy. the blocks keep their kv caches in slots forward_upmem() and
+// forward_upmem_batch() use as well, so they don't mix.
+float *forward_upmem_pipelined(Transformer *transformer, int block,
+                               const int *tokens, const int *pos, int batch);
+
+// sequences per block of forward_upmem_pipelined()
+int upmem_pipeline_batch(const Transformer *transformer);
+
+// releases the dpus and their kv caches, the next upmem forward plans the
+// partition again for transformer->upmem_ranks
+void free_upmem(void);
+
+// fewest ranks the model fits in and all ranks of the machine
+void upmem_rank_range(const Transformer *transformer, int *required,
+                      int *available);
+
+// dpus of the current partition
+int upmem_nr_dpus(void);
+
 float *forward(Transformer *transformer, int token, int pos);
 
+// like forward(), but for positions whose logits are not needed: the token is
+// done once the last layer has written its k and v into the cache
+void forward_kv_cpu(Transformer *transformer, int token, int pos);
+
+void forward_kv_upmem(Transformer *transformer, int token, int pos);
+
+void forward_kv(Transformer *transformer, int token, int pos);
+
+// runs n_tokens consecutive tokens of the sequence from position pos through
+// the transformer in one pass, filling the kv cache, and returns the logits of
+// the last one
+float *forward_prefill_cpu(Transformer *transformer, const int *tokens,
+                           int n_tokens, int pos);
+
+float *forward_prefill_upmem(Transformer *transformer, const int *tokens,
+                             int n_tokens, int pos);
+
+float *forward_prefill(Transformer *transformer, const int *tokens,
+                       int n_tokens, int pos);
+
 void print_vector(float *vec, int size);
 
 bool compare_vector(const char *name, float *a, float *b, size_t size);
 
-void mha_big_test(int pos);
+// long-context attention over seq_len positions of random data, the
+// positions of every head split over several dpus. setup returns the number
+// of dpus, error the largest difference of the last test to the host.
+// a benchmark-only prototype of sharded positions for -x: kernels/mha.c
+// doesn't shard, so the forward pass still keeps the cache of a kv head on
+// one dpu and seq_len is capped at MAX_SEQ_LEN.
+int mha_big_setup(int seq_len);
+
+void mha_big_test(void);
+
+float mha_big_error(void);
+
+// cycles per call of the dpu math functions of kernels/math.h and their
+// kernels/fast_math.h versions, and the largest error of the fast ones
+typedef struct {
+  const char *name;
+  uint32_t cycles;
+  uint32_t fast_cycles;
+  float error;
+} MathBench;
+
+#define MATH_BENCH_FUNCTIONS 5
+
+// runs kernels/math_bench.c on one dpu
+void math_bench(MathBench results[MATH_BENCH_FUNCTIONS]);
+
+void print_upmem_stats(void);
@@ -1,9 +1,20 @@
 /* Inference for Llama-2 Transformer model in pure C */
 
+// pthread_setaffinity_np()
+#define _GNU_SOURCE
+
 #include "transformer.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 // ----------------------------------------------------------------------------
 // neural net blocks; the dynamics of the Transformer
@@ -45,25 +56,1446 @@ void softmax(float *x, int size) {
   }
 }
 
+// dot products of MATMUL_ROWS consecutive rows of w (stride n) with x, each
+// element of x is loaded once for all of them
+#define MATMUL_ROWS 4
+typedef void (*DotRows)(float *out, const float *w, const float *x, int n);
+
+static void dot_rows_generic(float *out, const float *w, const float *x,
+                             int n) {
+  float acc[MATMUL_ROWS] = {0.0f};
+  for (int j = 0; j < n; j++) {
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      acc[r] += w[(size_t)r * n + j] * x[j];
+    }
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    out[r] = acc[r];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// compiled for the isa in their target attribute whatever the flags, only
+// called once the cpu reported it
+
+__attribute__((target("avx2,fma"))) static float hsum_avx2(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) static void
+dot_rows_avx2(float *out, const float *w, const float *x, int n) {
+  const float *w0 = w;
+  const float *w1 = w0 + n;
+  const float *w2 = w1 + n;
+  const float *w3 = w2 + n;
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  __m256 acc2 = _mm256_setzero_ps();
+  __m256 acc3 = _mm256_setzero_ps();
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    const __m256 xv = _mm256_loadu_ps(x + j);
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + j), xv, acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + j), xv, acc1);
+    acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + j), xv, acc2);
+    acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + j), xv, acc3);
+  }
+  out[0] = hsum_avx2(acc0);
+  out[1] = hsum_avx2(acc1);
+  out[2] = hsum_avx2(acc2);
+  out[3] = hsum_avx2(acc3);
+  for (; j < n; j++) {
+    out[0] += w0[j] * x[j];
+    out[1] += w1[j] * x[j];
+    out[2] += w2[j] * x[j];
+    out[3] += w3[j] * x[j];
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+dot_rows_avx512(float *out, const float *w, const float *x, int n) {
+  const float *w0 = w;
+  const float *w1 = w0 + n;
+  const float *w2 = w1 + n;
+  const float *w3 = w2 + n;
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  __m512 acc2 = _mm512_setzero_ps();
+  __m512 acc3 = _mm512_setzero_ps();
+  int j = 0;
+  for (; j + 16 <= n; j += 16) {
+    const __m512 xv = _mm512_loadu_ps(x + j);
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + j), xv, acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(w1 + j), xv, acc1);
+    acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(w2 + j), xv, acc2);
+    acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(w3 + j), xv, acc3);
+  }
+  // the rest of the row, masked
+  if (j < n) {
+    const __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+    const __m512 xv = _mm512_maskz_loadu_ps(m, x + j);
+    acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w0 + j), xv, acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w1 + j), xv, acc1);
+    acc2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w2 + j), xv, acc2);
+    acc3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w3 + j), xv, acc3);
+  }
+  out[0] = _mm512_reduce_add_ps(acc0);
+  out[1] = _mm512_reduce_add_ps(acc1);
+  out[2] = _mm512_reduce_add_ps(acc2);
+  out[3] = _mm512_reduce_add_ps(acc3);
+}
+#endif
+
+// the same for the q8 path: int8 rows of w with a scale per group of
+// group_size weights (stride n / group_size) and x quantized the same way.
+// every group is accumulated in int32 and scaled once.
+typedef void (*DotRowsQ8)(float *out, const int8_t *w, const float *ws,
+                          const int8_t *x, const float *xs, int n,
+                          int group_size);
+
+static void dot_rows_q8_generic(float *out, const int8_t *w, const float *ws,
+                                const int8_t *x, const float *xs, int n,
+                                int group_size) {
+  const int groups = n / group_size;
+  float acc[MATMUL_ROWS] = {0.0f};
+  for (int g = 0; g < groups; g++) {
+    const int8_t *wg = w + g * group_size;
+    const int8_t *xg = x + g * group_size;
+    int32_t iacc[MATMUL_ROWS] = {0};
+    for (int j = 0; j < group_size; j++) {
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        iacc[r] += (int32_t)wg[(size_t)r * n + j] * xg[j];
+      }
+    }
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      acc[r] += (float)iacc[r] * ws[(size_t)r * groups + g] * xs[g];
+    }
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    out[r] = acc[r];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 weights at a time widened to int16, for group sizes divisible by 16
+__attribute__((target("avx2,fma"))) static void
+dot_rows_q8_avx2(float *out, const int8_t *w, const float *ws, const int8_t *x,
+                 const float *xs, int n, int group_size) {
+  const int groups = n / group_size;
+  __m256 acc[MATMUL_ROWS];
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    acc[r] = _mm256_setzero_ps();
+  }
+  for (int g = 0; g < groups; g++) {
+    __m256i iacc[MATMUL_ROWS];
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      iacc[r] = _mm256_setzero_si256();
+    }
+    for (int j = g * group_size; j < (g + 1) * group_size; j += 16) {
+      const __m256i xv =
+          _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(x + j)));
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        const __m256i wv = _mm256_cvtepi8_epi16(
+            _mm_loadu_si128((const __m128i *)(w + (size_t)r * n + j)));
+        iacc[r] = _mm256_add_epi32(iacc[r], _mm256_madd_epi16(wv, xv));
+      }
+    }
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      const __m256 scale = _mm256_set1_ps(ws[(size_t)r * groups + g] * xs[g]);
+      acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc[r]), scale, acc[r]);
+    }
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    out[r] = hsum_avx2(acc[r]);
+  }
+}
+
+// 32 weights at a time, for group sizes divisible by 32
+__attribute__((target("avx512f,avx512bw"))) static void
+dot_rows_q8_avx512(float *out, const int8_t *w, const float *ws,
+                   const int8_t *x, const float *xs, int n, int group_size) {
+  const int groups = n / group_size;
+  __m512 acc[MATMUL_ROWS];
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    acc[r] = _mm512_setzero_ps();
+  }
+  for (int g = 0; g < groups; g++) {
+    __m512i iacc[MATMUL_ROWS];
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      iacc[r] = _mm512_setzero_si512();
+    }
+    for (int j = g * group_size; j < (g + 1) * group_size; j += 32) {
+      const __m512i xv =
+          _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)(x + j)));
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        const __m512i wv = _mm512_cvtepi8_epi16(
+            _mm256_loadu_si256((const __m256i *)(w + (size_t)r * n + j)));
+        iacc[r] = _mm512_add_epi32(iacc[r], _mm512_madd_epi16(wv, xv));
+      }
+    }
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      const __m512 scale = _mm512_set1_ps(ws[(size_t)r * groups + g] * xs[g]);
+      acc[r] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(iacc[r]), scale, acc[r]);
+    }
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    out[r] = _mm512_reduce_add_ps(acc[r]);
+  }
+}
+#endif
+
+// the same for weights repacked into panels (-k): a tile of MATMUL_ROWS
+// rows interleaved in blocks of PANEL_COLS columns, row 0 of the first block,
+// row 1 of it and so on, which the kernels read as one contiguous stream. a
+// block of a row is a cache line, one avx-512 or two avx2 loads.
+#define PANEL_COLS 16
+typedef void (*DotPanel)(float *out, const float *panel, const float *x,
+                         int n);
+
+static void dot_panel_generic(float *out, const float *panel, const float *x,
+                              int n) {
+  float acc[MATMUL_ROWS] = {0.0f};
+  for (int j = 0; j < n; j += PANEL_COLS) {
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      for (int c = 0; c < PANEL_COLS; c++) {
+        acc[r] += panel[r * PANEL_COLS + c] * x[j + c];
+      }
+    }
+    panel += MATMUL_ROWS * PANEL_COLS;
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    out[r] = acc[r];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) static void
+dot_panel_avx2(float *out, const float *panel, const float *x, int n) {
+  // two accumulators per row for the two halves of a block
+  __m256 acc[2 * MATMUL_ROWS];
+  for (int r = 0; r < 2 * MATMUL_ROWS; r++) {
+    acc[r] = _mm256_setzero_ps();
+  }
+  for (int j = 0; j < n; j += PANEL_COLS) {
+    const __m256 x0 = _mm256_loadu_ps(x + j);
+    const __m256 x1 = _mm256_loadu_ps(x + j + 8);
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      const float *p = panel + r * PANEL_COLS;
+      acc[2 * r] = _mm256_fmadd_ps(_mm256_loadu_ps(p), x0, acc[2 * r]);
+      acc[2 * r + 1] =
+          _mm256_fmadd_ps(_mm256_loadu_ps(p + 8), x1, acc[2 * r + 1]);
+    }
+    panel += MATMUL_ROWS * PANEL_COLS;
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    out[r] = hsum_avx2(_mm256_add_ps(acc[2 * r], acc[2 * r + 1]));
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+dot_panel_avx512(float *out, const float *panel, const float *x, int n) {
+  __m512 acc[MATMUL_ROWS];
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    acc[r] = _mm512_setzero_ps();
+  }
+  for (int j = 0; j < n; j += PANEL_COLS) {
+    const __m512 xv = _mm512_loadu_ps(x + j);
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      acc[r] =
+          _mm512_fmadd_ps(_mm512_loadu_ps(panel + r * PANEL_COLS), xv, acc[r]);
+    }
+    panel += MATMUL_ROWS * PANEL_COLS;
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    out[r] = _mm512_reduce_add_ps(acc[r]);
+  }
+}
+#endif
+
+// the fused projections (qkv, w1 and w3) multiply count <= FUSED_TILES tiles
+// of MATMUL_ROWS rows at once, tile m of them from w[m] on (stride n) into
+// out + m * MATMUL_ROWS. the tiles can come from different matrices of the
+// same input, each element of x is loaded once for all of their rows.
+#define FUSED_TILES 3
+typedef void (*DotTiles)(float *out, const float *const w[], const float *x,
+                         int n, int count);
+
+static void dot_tiles_generic(float *out, const float *const w[],
+                              const float *x, int n, int count) {
+  float acc[FUSED_TILES * MATMUL_ROWS] = {0.0f};
+  for (int j = 0; j < n; j++) {
+    for (int m = 0; m < count; m++) {
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        acc[m * MATMUL_ROWS + r] += w[m][(size_t)r * n + j] * x[j];
+      }
+    }
+  }
+  for (int r = 0; r < count * MATMUL_ROWS; r++) {
+    out[r] = acc[r];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// inlined with a constant count and unrolled, so the accumulators stay in
+// registers: 12 of the 16 ymm for three tiles
+__attribute__((target("avx2,fma"), always_inline)) static inline void
+dot_tiles_avx2_count(float *out, const float *const w[], const float *x,
+                     int n, const int count) {
+  __m256 acc[FUSED_TILES * MATMUL_ROWS];
+#pragma GCC unroll 12
+  for (int r = 0; r < count * MATMUL_ROWS; r++) {
+    acc[r] = _mm256_setzero_ps();
+  }
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    const __m256 xv = _mm256_loadu_ps(x + j);
+#pragma GCC unroll 12
+    for (int m = 0; m < count; m++) {
+#pragma GCC unroll 12
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        const float *row = w[m] + (size_t)r * n;
+        acc[m * MATMUL_ROWS + r] = _mm256_fmadd_ps(
+            _mm256_loadu_ps(row + j), xv, acc[m * MATMUL_ROWS + r]);
+      }
+    }
+  }
+#pragma GCC unroll 12
+  for (int m = 0; m < count; m++) {
+#pragma GCC unroll 12
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      const float *row = w[m] + (size_t)r * n;
+      float val = hsum_avx2(acc[m * MATMUL_ROWS + r]);
+      for (int k = j; k < n; k++) {
+        val += row[k] * x[k];
+      }
+      out[m * MATMUL_ROWS + r] = val;
+    }
+  }
+}
+
+__attribute__((target("avx2,fma"))) static void
+dot_tiles_avx2(float *out, const float *const w[], const float *x, int n,
+               int count) {
+  if (count == 3) {
+    dot_tiles_avx2_count(out, w, x, n, 3);
+  } else if (count == 2) {
+    dot_tiles_avx2_count(out, w, x, n, 2);
+  } else {
+    dot_tiles_avx2_count(out, w, x, n, 1);
+  }
+}
+
+__attribute__((target("avx512f"), always_inline)) static inline void
+dot_tiles_avx512_count(float *out, const float *const w[], const float *x,
+                       int n, const int count) {
+  __m512 acc[FUSED_TILES * MATMUL_ROWS];
+#pragma GCC unroll 12
+  for (int r = 0; r < count * MATMUL_ROWS; r++) {
+    acc[r] = _mm512_setzero_ps();
+  }
+  int j = 0;
+  for (; j + 16 <= n; j += 16) {
+    const __m512 xv = _mm512_loadu_ps(x + j);
+#pragma GCC unroll 12
+    for (int m = 0; m < count; m++) {
+#pragma GCC unroll 12
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        const float *row = w[m] + (size_t)r * n;
+        acc[m * MATMUL_ROWS + r] = _mm512_fmadd_ps(
+            _mm512_loadu_ps(row + j), xv, acc[m * MATMUL_ROWS + r]);
+      }
+    }
+  }
+  // the rest of the rows, masked
+  if (j < n) {
+    const __mmask16 mask = (__mmask16)((1u << (n - j)) - 1);
+    const __m512 xv = _mm512_maskz_loadu_ps(mask, x + j);
+#pragma GCC unroll 12
+    for (int m = 0; m < count; m++) {
+#pragma GCC unroll 12
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        const float *row = w[m] + (size_t)r * n;
+        acc[m * MATMUL_ROWS + r] =
+            _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, row + j), xv,
+                            acc[m * MATMUL_ROWS + r]);
+      }
+    }
+  }
+#pragma GCC unroll 12
+  for (int r = 0; r < count * MATMUL_ROWS; r++) {
+    out[r] = _mm512_reduce_add_ps(acc[r]);
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+dot_tiles_avx512(float *out, const float *const w[], const float *x, int n,
+                 int count) {
+  if (count == 3) {
+    dot_tiles_avx512_count(out, w, x, n, 3);
+  } else if (count == 2) {
+    dot_tiles_avx512_count(out, w, x, n, 2);
+  } else {
+    dot_tiles_avx512_count(out, w, x, n, 1);
+  }
+}
+#endif
+
+// the same for the q8 path, ws[m] the scales of tile m
+typedef void (*DotTilesQ8)(float *out, const int8_t *const w[],
+                           const float *const ws[], const int8_t *x,
+                           const float *xs, int n, int group_size, int count);
+
+static void dot_tiles_q8_generic(float *out, const int8_t *const w[],
+                                 const float *const ws[], const int8_t *x,
+                                 const float *xs, int n, int group_size,
+                                 int count) {
+  const int groups = n / group_size;
+  float acc[FUSED_TILES * MATMUL_ROWS] = {0.0f};
+  for (int g = 0; g < groups; g++) {
+    const int8_t *xg = x + g * group_size;
+    int32_t iacc[FUSED_TILES * MATMUL_ROWS] = {0};
+    for (int j = 0; j < group_size; j++) {
+      for (int m = 0; m < count; m++) {
+        const int8_t *wg = w[m] + g * group_size;
+        for (int r = 0; r < MATMUL_ROWS; r++) {
+          iacc[m * MATMUL_ROWS + r] += (int32_t)wg[(size_t)r * n + j] * xg[j];
+        }
+      }
+    }
+    for (int m = 0; m < count; m++) {
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        acc[m * MATMUL_ROWS + r] += (float)iacc[m * MATMUL_ROWS + r] *
+                                    ws[m][(size_t)r * groups + g] * xs[g];
+      }
+    }
+  }
+  for (int r = 0; r < count * MATMUL_ROWS; r++) {
+    out[r] = acc[r];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// int32 and float accumulators of every row take 24 of the 32 zmm for three
+// tiles. on avx2 they would spill, so it takes the tiles one at a time.
+__attribute__((target("avx2,fma"))) static void
+dot_tiles_q8_avx2(float *out, const int8_t *const w[], const float *const ws[],
+                  const int8_t *x, const float *xs, int n, int group_size,
+                  int count) {
+  for (int m = 0; m < count; m++) {
+    dot_rows_q8_avx2(out + m * MATMUL_ROWS, w[m], ws[m], x, xs, n, group_size);
+  }
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline)) static inline void
+dot_tiles_q8_avx512_count(float *out, const int8_t *const w[],
+                          const float *const ws[], const int8_t *x,
+                          const float *xs, int n, int group_size,
+                          const int count) {
+  const int groups = n / group_size;
+  __m512 acc[FUSED_TILES * MATMUL_ROWS];
+#pragma GCC unroll 12
+  for (int r = 0; r < count * MATMUL_ROWS; r++) {
+    acc[r] = _mm512_setzero_ps();
+  }
+  for (int g = 0; g < groups; g++) {
+    __m512i iacc[FUSED_TILES * MATMUL_ROWS];
+#pragma GCC unroll 12
+    for (int r = 0; r < count * MATMUL_ROWS; r++) {
+      iacc[r] = _mm512_setzero_si512();
+    }
+    for (int j = g * group_size; j < (g + 1) * group_size; j += 32) {
+      const __m512i xv =
+          _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)(x + j)));
+#pragma GCC unroll 12
+      for (int m = 0; m < count; m++) {
+#pragma GCC unroll 12
+        for (int r = 0; r < MATMUL_ROWS; r++) {
+          const __m512i wv = _mm512_cvtepi8_epi16(_mm256_loadu_si256(
+              (const __m256i *)(w[m] + (size_t)r * n + j)));
+          iacc[m * MATMUL_ROWS + r] = _mm512_add_epi32(
+              iacc[m * MATMUL_ROWS + r], _mm512_madd_epi16(wv, xv));
+        }
+      }
+    }
+#pragma GCC unroll 12
+    for (int m = 0; m < count; m++) {
+#pragma GCC unroll 12
+      for (int r = 0; r < MATMUL_ROWS; r++) {
+        const __m512 scale =
+            _mm512_set1_ps(ws[m][(size_t)r * groups + g] * xs[g]);
+        acc[m * MATMUL_ROWS + r] =
+            _mm512_fmadd_ps(_mm512_cvtepi32_ps(iacc[m * MATMUL_ROWS + r]),
+                            scale, acc[m * MATMUL_ROWS + r]);
+      }
+    }
+  }
+#pragma GCC unroll 12
+  for (int r = 0; r < count * MATMUL_ROWS; r++) {
+    out[r] = _mm512_reduce_add_ps(acc[r]);
+  }
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+dot_tiles_q8_avx512(float *out, const int8_t *const w[],
+                    const float *const ws[], const int8_t *x, const float *xs,
+                    int n, int group_size, int count) {
+  if (count == 3) {
+    dot_tiles_q8_avx512_count(out, w, ws, x, xs, n, group_size, 3);
+  } else if (count == 2) {
+    dot_tiles_q8_avx512_count(out, w, ws, x, xs, n, group_size, 2);
+  } else {
+    dot_tiles_q8_avx512_count(out, w, ws, x, xs, n, group_size, 1);
+  }
+}
+#endif
+
+static DotRows dot_rows = NULL;
+static DotPanel dot_panel = NULL;
+static DotTiles dot_tiles = NULL;
+static const char *dot_rows_isa = "generic";
+
+// picks the widest kernel the cpu supports, once
+static void select_dot_rows(void) {
+  if (dot_rows) {
+    return;
+  }
+  dot_rows = dot_rows_generic;
+  dot_panel = dot_panel_generic;
+  dot_tiles = dot_tiles_generic;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    dot_rows = dot_rows_avx512;
+    dot_panel = dot_panel_avx512;
+    dot_tiles = dot_tiles_avx512;
+    dot_rows_isa = "avx512";
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    dot_rows = dot_rows_avx2;
+    dot_panel = dot_panel_avx2;
+    dot_tiles = dot_tiles_avx2;
+    dot_rows_isa = "avx2";
+  }
+#endif
+}
+
+const char *matmul_isa(void) {
+  select_dot_rows();
+  return dot_rows_isa;
+}
+
+// ----------------------------------------------------------------------------
+// persistent worker threads of the cpu backend. a run calls the same function
+// on every thread, which takes its share of each step and meets the others in
+// pool_barrier() before the next one, so a token only wakes the workers once
+// instead of forking and joining around every loop.
+
+typedef void (*PoolFn)(void *arg, int thread);
+
+static struct {
+  int n_threads; // including the calling thread, thread 0
+  pthread_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  unsigned run;  // incremented by every run, the workers sleep in between
+  bool quit;
+  PoolFn fn;
+  void *arg;
+  atomic_int busy; // workers still in the current run
+  atomic_int arrived;
+  atomic_uint phase; // of the barrier, incremented once all threads arrived
+} pool = {.n_threads = 1,
+          .lock = PTHREAD_MUTEX_INITIALIZER,
+          .wake = PTHREAD_COND_INITIALIZER};
+
+// busy waits are short between the steps of a token, but yield the core
+// once the threads outnumber the cores
+#define SPIN_LIMIT 1024
+
+static void *pool_worker(void *arg) {
+  const int thread = (int)(intptr_t)arg;
+  unsigned seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.run == seen && !pool.quit) {
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    if (pool.quit) {
+      pthread_mutex_unlock(&pool.lock);
+      return NULL;
+    }
+    seen = pool.run;
+    const PoolFn fn = pool.fn;
+    void *fn_arg = pool.arg;
+    pthread_mutex_unlock(&pool.lock);
+
+    fn(fn_arg, thread);
+    atomic_fetch_sub(&pool.busy, 1);
+  }
+}
+
+static void free_pool(void) {
+  if (pool.n_threads == 1) {
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = true;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+  for (int t = 1; t < pool.n_threads; t++) {
+    pthread_join(pool.workers[t - 1], NULL);
+  }
+  free(pool.workers);
+  pool.workers = NULL;
+  pool.n_threads = 1;
+  pool.quit = false;
+  pool.run = 0;
+}
+
+// (re)starts the pool with n_threads threads, one per online core for 0.
+// worker t is pinned to core t, the calling thread keeps its affinity.
+static void start_pool(int n_threads) {
+  const int n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads <= 0) {
+    n_threads = n_cores > 0 ? n_cores : 1;
+  }
+  if (n_threads == pool.n_threads) {
+    return;
+  }
+  free_pool();
+  if (n_threads == 1) {
+    return;
+  }
+
+  pool.workers = malloc((n_threads - 1) * sizeof(pthread_t));
+  for (int t = 1; t < n_threads; t++) {
+    if (pthread_create(&pool.workers[t - 1], NULL, pool_worker,
+                       (void *)(intptr_t)t) != 0) {
+      fprintf(stderr, "pthread_create failed!\n");
+      exit(EXIT_FAILURE);
+    }
+#ifdef __linux__
+    if (n_cores > 0) {
+      cpu_set_t cores;
+      CPU_ZERO(&cores);
+      CPU_SET(t % n_cores, &cores);
+      pthread_setaffinity_np(pool.workers[t - 1], sizeof(cores), &cores);
+    }
+#endif
+  }
+  pool.n_threads = n_threads;
+}
+
+// calls fn(arg, thread) on every thread of the pool and returns once all
+// of them are done
+static void pool_run(PoolFn fn, void *arg) {
+  if (pool.n_threads == 1) {
+    fn(arg, 0);
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.fn = fn;
+  pool.arg = arg;
+  atomic_store(&pool.busy, pool.n_threads - 1);
+  pool.run++;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  fn(arg, 0);
+  for (int spins = 0; atomic_load(&pool.busy) > 0; spins++) {
+    if (spins >= SPIN_LIMIT) {
+      sched_yield();
+    }
+  }
+}
+
+// waits for every thread of the current run
+static void pool_barrier(void) {
+  if (pool.n_threads == 1) {
+    return;
+  }
+  const unsigned phase = atomic_load(&pool.phase);
+  if (atomic_fetch_add(&pool.arrived, 1) == pool.n_threads - 1) {
+    atomic_store(&pool.arrived, 0);
+    atomic_fetch_add(&pool.phase, 1);
+    return;
+  }
+  for (int spins = 0; atomic_load(&pool.phase) == phase; spins++) {
+    if (spins >= SPIN_LIMIT) {
+      sched_yield();
+    }
+  }
+}
+
+// the rows [*begin, *end) of d rows of a thread, in whole tiles of
+// MATMUL_ROWS so pairs of rows stay together
+static void thread_rows(int d, int thread, int *begin, int *end) {
+  const int tiles = (d + MATMUL_ROWS - 1) / MATMUL_ROWS;
+  *begin = tiles * thread / pool.n_threads * MATMUL_ROWS;
+  *end = tiles * (thread + 1) / pool.n_threads * MATMUL_ROWS;
+  if (*end > d) {
+    *end = d;
+  }
+  if (*begin > d) {
+    *begin = d;
+  }
+}
+
+// ----------------------------------------------------------------------------
+// weights repacked into panels at the first forward (-k). a matrix of d rows
+// takes d rounded up to MATMUL_ROWS rows of panels, the rows added are zero.
+// tensors with rows of a length not divisible by PANEL_COLS stay row-major.
+
+// the panels of a float tensor of layers of (d, n) matrices
+typedef struct {
+  const float *w; // the row-major tensor
+  float *panels;
+  size_t size; // floats of w
+} PackedTensor;
+
+// the tensors of the model, wq to wcls
+#define PACKED_TENSORS 8
+
+static struct {
+  PackedTensor tensors[PACKED_TENSORS];
+  int count;
+  bool done;
+} packed;
+
+// rows rounded up to whole panels
+static size_t panel_rows(int d) {
+  return (size_t)(d + MATMUL_ROWS - 1) / MATMUL_ROWS * MATMUL_ROWS;
+}
+
+// repacks the matrices of w into panels
+static void pack_tensor(PackedTensor *t, const float *w, int layers, int n,
+                        int d) {
+  const size_t rows = panel_rows(d);
+  t->w = w;
+  t->size = (size_t)layers * d * n;
+  // blocks start on a cache line, so every one is a single line. the size is
+  // a multiple of it, as n is of PANEL_COLS.
+  const size_t size = (size_t)layers * rows * n * sizeof(float);
+  t->panels = aligned_alloc(PANEL_COLS * sizeof(float), size);
+  if (!t->panels) {
+    fprintf(stderr, "malloc failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(t->panels, 0, size);
+  for (int l = 0; l < layers; l++) {
+    const float *m = w + (size_t)l * d * n;
+    float *panels = t->panels + (size_t)l * rows * n;
+    for (int i = 0; i < d; i++) {
+      // tile i / MATMUL_ROWS starts at row i - i % MATMUL_ROWS, row i of
+      // each of its blocks at i % MATMUL_ROWS
+      float *panel = panels + (size_t)(i - i % MATMUL_ROWS) * n +
+                     (i % MATMUL_ROWS) * PANEL_COLS;
+      for (int j = 0; j < n; j += PANEL_COLS) {
+        memcpy(panel + (size_t)j * MATMUL_ROWS, m + (size_t)i * n + j,
+               PANEL_COLS * sizeof(float));
+      }
+    }
+  }
+}
+
+static void free_packed(void) {
+  for (int t = 0; t < packed.count; t++) {
+    free(packed.tensors[t].panels);
+  }
+  packed.count = 0;
+  packed.done = false;
+}
+
+// repacks the tensors of the model once
+static void start_packed(Transformer *transformer) {
+  if (packed.done) {
+    return;
+  }
+  Config *p = &transformer->config;
+  TransformerWeights *w = &transformer->weights;
+  int dim = p->dim;
+  int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+  int hidden_dim = p->hidden_dim;
+  int layers = p->n_layers;
+  const struct {
+    const float *w;
+    int layers, n, d;
+  } tensors[PACKED_TENSORS] = {
+      {w->wq, layers, dim, dim},        {w->wk, layers, dim, kv_dim},
+      {w->wv, layers, dim, kv_dim},     {w->wo, layers, dim, dim},
+      {w->w1, layers, dim, hidden_dim}, {w->w2, layers, hidden_dim, dim},
+      {w->w3, layers, dim, hidden_dim}, {w->wcls, 1, dim, p->vocab_size},
+  };
+  for (int t = 0; t < PACKED_TENSORS; t++) {
+    if (tensors[t].n % PANEL_COLS == 0) {
+      pack_tensor(&packed.tensors[packed.count++], tensors[t].w,
+                  tensors[t].layers, tensors[t].n, tensors[t].d);
+    }
+  }
+  packed.done = true;
+}
+
+// the panels of the (d, n) matrix at w, NULL unless it was repacked
+static const float *find_panels(const float *w, int n, int d) {
+  for (int t = 0; t < packed.count; t++) {
+    const PackedTensor *tensor = &packed.tensors[t];
+    if (w >= tensor->w && w < tensor->w + tensor->size) {
+      const size_t l = (size_t)(w - tensor->w) / ((size_t)d * n);
+      return tensor->panels + l * panel_rows(d) * n;
+    }
+  }
+  return NULL;
+}
+
+// matmul_rows() on the panels of W, begin has to start a panel
+static void matmul_panels(float *xout, const float *x, const float *panels,
+                          int n, int d, int batch, int begin, int end) {
+  const DotPanel dot = dot_panel;
+  for (int i = begin; i < end; i += MATMUL_ROWS) {
+    const float *panel = panels + (size_t)i * n;
+    const int rows = end - i < MATMUL_ROWS ? end - i : MATMUL_ROWS;
+    for (int b = 0; b < batch; b++) {
+      float val[MATMUL_ROWS];
+      dot(val, panel, x + (size_t)b * n, n);
+      memcpy(xout + (size_t)b * d + i, val, rows * sizeof(float));
+    }
+  }
+}
+
+// rows [begin, end) of W (d,n) @ x (batch,n) -> xout (batch,d). every tile
+// of MATMUL_ROWS rows of W is loaded once for the whole batch, the rows left
+// over take the scalar loop. repacked weights go to matmul_panels().
+static void matmul_rows(float *xout, const float *x, const float *w, int n,
+                        int d, int batch, int begin, int end) {
+  const float *panels = find_panels(w, n, d);
+  if (panels) {
+    matmul_panels(xout, x, panels, n, d, batch, begin, end);
+    return;
+  }
+  const DotRows dot = dot_rows;
+  for (int i = begin; i < end; i += MATMUL_ROWS) {
+    const float *rows = w + (size_t)i * n;
+    for (int b = 0; b < batch; b++) {
+      const float *xb = x + (size_t)b * n;
+      float *out = xout + (size_t)b * d + i;
+      if (i + MATMUL_ROWS <= end) {
+        float val[MATMUL_ROWS];
+        dot(val, rows, xb, n);
+        memcpy(out, val, sizeof(val));
+        continue;
+      }
+      for (int r = 0; r < end - i; r++) {
+        float val = 0.0f;
+        for (int j = 0; j < n; j++) {
+          val += rows[(size_t)r * n + j] * xb[j];
+        }
+        out[r] = val;
+      }
+    }
+  }
+}
+
+static double bench_ms(void) {
+  struct timespec time;
+  timespec_get(&time, TIME_UTC);
+  return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+// ----------------------------------------------------------------------------
+// the q8 path of the cpu backend (-c) multiplies int8 weights with int8
+// activations, each with a scale per group of group_size values along the
+// rows. the weights are quantized from the float ones at its first forward,
+// which only read their token embeddings from then on.
+
+// the int8 version of a float tensor of layers of (d, n) matrices
+typedef struct {
+  int8_t *q; // (layers, d, n)
+  float *s;  // (layers, d, n / group_size)
+} QTensor;
+
+static struct {
+  int group_size; // 0 until the weights are quantized
+  DotRowsQ8 dot;
+  DotTilesQ8 dot_tiles;
+  QTensor wq, wk, wv, wo, w1, w2, w3, wcls;
+  // quantized inputs of the matmuls, size values and their scales
+  int8_t *xq;
+  float *xs;
+  size_t size;
+} q8;
+
+// rows [begin, end) of matrix row0 / d of w (d,n) @ x (batch,n) -> xout
+// (batch,d) with x quantized in xq and xs
+static void matmul_rows_q8(float *xout, const int8_t *xq, const float *xs,
+                           const QTensor *w, size_t row0, int n, int d,
+                           int batch, int begin, int end) {
+  const int group_size = q8.group_size;
+  const int groups = n / group_size;
+  for (int i = begin; i < end; i += MATMUL_ROWS) {
+    const int8_t *rows = w->q + (row0 + i) * n;
+    const float *scales = w->s + (row0 + i) * groups;
+    for (int b = 0; b < batch; b++) {
+      const int8_t *xqb = xq + (size_t)b * n;
+      const float *xsb = xs + (size_t)b * groups;
+      float *out = xout + (size_t)b * d + i;
+      if (i + MATMUL_ROWS <= end) {
+        float val[MATMUL_ROWS];
+        q8.dot(val, rows, scales, xqb, xsb, n, group_size);
+        memcpy(out, val, sizeof(val));
+        continue;
+      }
+      for (int r = 0; r < end - i; r++) {
+        float val = 0.0f;
+        for (int g = 0; g < groups; g++) {
+          int32_t acc = 0;
+          for (int j = g * group_size; j < (g + 1) * group_size; j++) {
+            acc += (int32_t)rows[(size_t)r * n + j] * xqb[j];
+          }
+          val += (float)acc * scales[(size_t)r * groups + g] * xsb[g];
+        }
+        out[r] = val;
+      }
+    }
+  }
+}
+
+// makes room for size quantized input values
+static void reserve_q8_inputs(size_t size) {
+  if (size <= q8.size) {
+    return;
+  }
+  free(q8.xq);
+  free(q8.xs);
+  q8.xq = malloc(size);
+  q8.xs = malloc(size / q8.group_size * sizeof(float));
+  if (!q8.xq || !q8.xs) {
+    fprintf(stderr, "malloc failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  q8.size = size;
+}
+
+static void quantize_tensor(QTensor *t, const float *x, size_t size,
+                            int group_size) {
+  t->q = malloc(size);
+  t->s = malloc(size / group_size * sizeof(float));
+  if (!t->q || !t->s) {
+    fprintf(stderr, "malloc failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  quantize(t->q, t->s, x, size, group_size);
+}
+
+static void free_tensor(QTensor *t) {
+  free(t->q);
+  free(t->s);
+  t->q = NULL;
+  t->s = NULL;
+}
+
+// quantizes the weights of the q8 path once, in the groups of a q8
+// checkpoint so they come out as stored
+static void start_q8(Transformer *transformer) {
+  if (q8.group_size > 0) {
+    return;
+  }
+  Config *p = &transformer->config;
+  TransformerWeights *w = &transformer->weights;
+  const int group_size = transformer->group_size > 0
+                             ? transformer->group_size
+                             : default_group_size(p);
+  size_t n_layers = p->n_layers;
+  size_t dim = p->dim;
+  size_t kv_dim = p->n_kv_heads * (dim / p->n_heads);
+  size_t hidden_dim = p->hidden_dim;
+  quantize_tensor(&q8.wq, w->wq, n_layers * dim * dim, group_size);
+  quantize_tensor(&q8.wk, w->wk, n_layers * dim * kv_dim, group_size);
+  quantize_tensor(&q8.wv, w->wv, n_layers * dim * kv_dim, group_size);
+  quantize_tensor(&q8.wo, w->wo, n_layers * dim * dim, group_size);
+  quantize_tensor(&q8.w1, w->w1, n_layers * dim * hidden_dim, group_size);
+  quantize_tensor(&q8.w2, w->w2, n_layers * dim * hidden_dim, group_size);
+  quantize_tensor(&q8.w3, w->w3, n_layers * dim * hidden_dim, group_size);
+  quantize_tensor(&q8.wcls, w->wcls, (size_t)p->vocab_size * dim, group_size);
+  q8.group_size = group_size;
+
+  q8.dot = dot_rows_q8_generic;
+  q8.dot_tiles = dot_tiles_q8_generic;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw") && group_size % 32 == 0) {
+    q8.dot = dot_rows_q8_avx512;
+    q8.dot_tiles = dot_tiles_q8_avx512;
+  } else if (__builtin_cpu_supports("avx2") &&
+             __builtin_cpu_supports("fma") && group_size % 16 == 0) {
+    q8.dot = dot_rows_q8_avx2;
+    q8.dot_tiles = dot_tiles_q8_avx2;
+  }
+#endif
+}
+
+static void free_q8(void) {
+  free_tensor(&q8.wq);
+  free_tensor(&q8.wk);
+  free_tensor(&q8.wv);
+  free_tensor(&q8.wo);
+  free_tensor(&q8.w1);
+  free_tensor(&q8.w2);
+  free_tensor(&q8.w3);
+  free_tensor(&q8.wcls);
+  free(q8.xq);
+  free(q8.xs);
+  q8.xq = NULL;
+  q8.xs = NULL;
+  q8.size = 0;
+  q8.group_size = 0;
+}
+
+void free_cpu(void) {
+  free_pool();
+  free_q8();
+  free_packed();
+}
+
+size_t cpu_weight_bytes(const Transformer *transformer) {
+  const Config *p = &transformer->config;
+  size_t dim = p->dim;
+  size_t kv_dim = p->n_kv_heads * (dim / p->n_heads);
+  size_t hidden_dim = p->hidden_dim;
+  size_t weights =
+      p->n_layers * (2 * dim * dim + 2 * dim * kv_dim + 3 * dim * hidden_dim) +
+      (size_t)p->vocab_size * dim;
+  if (!transformer->cpu_q8) {
+    return weights * sizeof(float);
+  }
+  const int group_size = transformer->group_size > 0
+                             ? transformer->group_size
+                             : default_group_size(p);
+  return weights + weights / group_size * sizeof(float);
+}
+
+struct MatmulJob {
+  float *xout, *x, *w;
+  int n, d, batch;
+  // set for the q8 path instead of w: matrix row0 / d of qw and the
+  // quantized x
+  const QTensor *qw;
+  size_t row0;
+  const int8_t *xq;
+  const float *xs;
+};
+
+static void matmul_thread(void *arg, int thread) {
+  const struct MatmulJob *job = arg;
+  int begin, end;
+  thread_rows(job->d, thread, &begin, &end);
+  if (job->qw) {
+    matmul_rows_q8(job->xout, job->xq, job->xs, job->qw, job->row0, job->n,
+                   job->d, job->batch, begin, end);
+  } else {
+    matmul_rows(job->xout, job->x, job->w, job->n, job->d, job->batch, begin,
+                end);
+  }
+}
+
 void matmul(float *xout, float *x, float *w, int n, int d) {
   // W (d,n) @ x (n,) -> xout (d,)
   // by far the most amount of time is spent inside this little function
+  matmul_batch(xout, x, w, n, d, 1);
+}
+
+void matmul_batch(float *xout, float *x, float *w, int n, int d, int batch) {
+  // W (d,n) @ x (batch,n) -> xout (batch,d), the rows split over the pool
+  select_dot_rows();
+  struct MatmulJob job = {xout, x, w, n, d, batch, NULL, 0, NULL, NULL};
+  pool_run(matmul_thread, &job);
+}
+
+// matmul_batch() with matrix l of the float tensor w, or of its int8 version
+// qw on the q8 path
+static void matmul_layer(float *xout, float *x, float *w, const QTensor *qw,
+                         size_t l, int n, int d, int batch) {
+  if (!qw) {
+    matmul_batch(xout, x, w + l * n * d, n, d, batch);
+    return;
+  }
+  // the groups of a row never reach into the next one
+  reserve_q8_inputs((size_t)batch * n);
+  quantize(q8.xq, q8.xs, x, (size_t)batch * n, q8.group_size);
+  struct MatmulJob job = {xout, x, NULL, n, d, batch, qw, l * d, q8.xq, q8.xs};
+  pool_run(matmul_thread, &job);
+}
+
+void quantize(int8_t *q, float *s, const float *x, size_t n, int group_size) {
+  for (size_t g = 0; g < n / group_size; g++) {
+    // the largest magnitude of the group maps to 127
+    float wmax = 0.0f;
+    for (int i = 0; i < group_size; i++) {
+      float val = fabsf(x[g * group_size + i]);
+      if (val > wmax) {
+        wmax = val;
+      }
+    }
+
+    float scale = wmax / 127.0f;
+    s[g] = scale;
+    for (int i = 0; i < group_size; i++) {
+      float val = scale > 0.0f ? x[g * group_size + i] / scale : 0.0f;
+      q[g * group_size + i] = (int8_t)roundf(val);
+    }
+  }
+}
+
+void dequantize(float *x, const int8_t *q, const float *s, size_t n,
+                int group_size) {
+  for (size_t i = 0; i < n; i++) {
+    x[i] = q[i] * s[i / group_size];
+  }
+}
+
+int default_group_size(const Config *p) {
+  int group_size = 64;
+  while (p->dim % group_size != 0 || p->hidden_dim % group_size != 0) {
+    group_size /= 2;
+  }
+  return group_size;
+}
+
+// ----------------------------------------------------------------------------
+// fused projections: the matrices multiplied with the same input are taken as
+// one, wq, wk and wv as their concatenated rows and w1 and w3 tile by tile.
+// up to FUSED_TILES tiles of them go through dot_tiles with a single pass
+// over x, and the epilogue (RoPE, SwiGLU) is applied to the products of a
+// tile before anything is stored
+
+// matrix l of the float tensor w (d,n), or of its int8 version qw on the q8
+// path
+typedef struct {
+  float *w;
+  const QTensor *qw;
+  size_t l;
+  int n, d;
+} Projection;
+
+static int tiles(int d) { return (d + MATMUL_ROWS - 1) / MATMUL_ROWS; }
+
+// the tiles [*begin, *end) of a thread
+static void thread_tiles(int n_tiles, int thread, int *begin, int *end) {
+  *begin = n_tiles * thread / pool.n_threads;
+  *end = n_tiles * (thread + 1) / pool.n_threads;
+}
+
+// the dot products of rows [i, i + MATMUL_ROWS) of p with vector b of x
+// (batch,n), or of x quantized into xq and xs on the q8 path. rows past the
+// end are zero.
+static void tile_dot(float *val, const Projection *p, const float *x,
+                     const int8_t *xq, const float *xs, int b, int i) {
+  const int n = p->n;
+  const int rows = p->d - i < MATMUL_ROWS ? p->d - i : MATMUL_ROWS;
+  if (p->qw) {
+    const int group_size = q8.group_size;
+    const int groups = n / group_size;
+    xq += (size_t)b * n;
+    xs += (size_t)b * groups;
+    const int8_t *w = p->qw->q + (p->l * p->d + i) * n;
+    const float *ws = p->qw->s + (p->l * p->d + i) * groups;
+    if (rows == MATMUL_ROWS) {
+      q8.dot(val, w, ws, xq, xs, n, group_size);
+      return;
+    }
+    for (int r = 0; r < MATMUL_ROWS; r++) {
+      val[r] = 0.0f;
+      for (int g = 0; r < rows && g < groups; g++) {
+        int32_t acc = 0;
+        for (int j = g * group_size; j < (g + 1) * group_size; j++) {
+          acc += (int32_t)w[(size_t)r * n + j] * xq[j];
+        }
+        val[r] += (float)acc * ws[(size_t)r * groups + g] * xs[g];
+      }
+    }
+    return;
+  }
+  x += (size_t)b * n;
+  const float *w = p->w + p->l * p->d * n;
+  const float *panels = find_panels(w, n, p->d);
+  if (panels) {
+    dot_panel(val, panels + (size_t)i * n, x, n);
+    return;
+  }
+  w += (size_t)i * n;
+  if (rows == MATMUL_ROWS) {
+    dot_rows(val, w, x, n);
+    return;
+  }
+  for (int r = 0; r < MATMUL_ROWS; r++) {
+    val[r] = 0.0f;
+    for (int j = 0; r < rows && j < n; j++) {
+      val[r] += w[(size_t)r * n + j] * x[j];
+    }
+  }
+}
+
+// rows [i, i + MATMUL_ROWS) of a projection
+typedef struct {
+  const Projection *p;
   int i;
-#pragma omp parallel for private(i)
-  for (i = 0; i < d; i++) {
-    float val = 0.0f;
-    for (int j = 0; j < n; j++) {
-      val += w[i * n + j] * x[j];
+} Tile;
+
+// tile_dot() of count tiles into val (count, MATMUL_ROWS). whole tiles of
+// row-major or int8 weights are multiplied together, panels and the tiles
+// with rows past the end one at a time.
+static void tiles_dot(float *val, const Tile tile[], int count,
+                      const float *x, const int8_t *xq, const float *xs,
+                      int b) {
+  bool fused = count > 1;
+  for (int m = 0; m < count && fused; m++) {
+    const Projection *p = tile[m].p;
+    fused = p->d - tile[m].i >= MATMUL_ROWS &&
+            (p->qw || !find_panels(p->w + p->l * p->d * p->n, p->n, p->d));
+  }
+  if (!fused) {
+    for (int m = 0; m < count; m++) {
+      tile_dot(val + m * MATMUL_ROWS, tile[m].p, x, xq, xs, b, tile[m].i);
+    }
+    return;
+  }
+  const int n = tile[0].p->n;
+  if (tile[0].p->qw) {
+    const int groups = n / q8.group_size;
+    const int8_t *w[FUSED_TILES];
+    const float *ws[FUSED_TILES];
+    for (int m = 0; m < count; m++) {
+      const Projection *p = tile[m].p;
+      const size_t row = p->l * p->d + tile[m].i;
+      w[m] = p->qw->q + row * n;
+      ws[m] = p->qw->s + row * groups;
     }
-    xout[i] = val;
+    q8.dot_tiles(val, w, ws, xq + (size_t)b * n, xs + (size_t)b * groups, n,
+                 q8.group_size, count);
+    return;
   }
+  const float *w[FUSED_TILES];
+  for (int m = 0; m < count; m++) {
+    const Projection *p = tile[m].p;
+    w[m] = p->w + (p->l * p->d + tile[m].i) * n;
+  }
+  dot_tiles(val, w, x + (size_t)b * n, n, count);
 }
 
-float *forward_cpu(Transformer *transformer, int token, int pos) {
+// RoPE relative positional encoding: complex-valued rotate the pairs of a
+// tile of rows from row i on
+static void rope_tile(float *val, const float *rope, int head_size, int i,
+                      int rows) {
+  for (int r = 0; r < rows; r += 2) {
+    int head_dim = (i + r) % head_size;
+    float fcr = rope[head_dim];
+    float fci = rope[head_dim + 1];
+    float v0 = val[r];
+    float v1 = val[r + 1];
+    val[r] = v0 * fcr - v1 * fci;
+    val[r + 1] = v0 * fci + v1 * fcr;
+  }
+}
+
+// q, k and v of batch consecutive positions (x: batch,n) from the tiles
+// [begin, end) of the rows of wq, wk and wv one after the other, q and k
+// rotated for the positions from rope on
+static void qkv_tiles(float *const out[3], const Projection proj[3],
+                      const float *x, const int8_t *xq, const float *xs,
+                      const float *rope, int head_size, int batch, int begin,
+                      int end) {
+  for (int t0 = begin; t0 < end; t0 += FUSED_TILES) {
+    const int count = end - t0 < FUSED_TILES ? end - t0 : FUSED_TILES;
+    Tile tile[FUSED_TILES];
+    int matrix[FUSED_TILES];
+    for (int k = 0; k < count; k++) {
+      int t = t0 + k;
+      int m = 0;
+      while (t >= tiles(proj[m].d)) {
+        t -= tiles(proj[m].d);
+        m++;
+      }
+      tile[k] = (Tile){&proj[m], t * MATMUL_ROWS};
+      matrix[k] = m;
+    }
+    for (int b = 0; b < batch; b++) {
+      float val[FUSED_TILES * MATMUL_ROWS];
+      tiles_dot(val, tile, count, x, xq, xs, b);
+      for (int k = 0; k < count; k++) {
+        const Projection *p = tile[k].p;
+        const int i = tile[k].i;
+        const int rows = p->d - i < MATMUL_ROWS ? p->d - i : MATMUL_ROWS;
+        float *tile_val = val + k * MATMUL_ROWS;
+        if (matrix[k] < 2) {
+          rope_tile(tile_val, rope + b * head_size, head_size, i, rows);
+        }
+        memcpy(out[matrix[k]] + (size_t)b * p->d + i, tile_val,
+               rows * sizeof(float));
+      }
+    }
+  }
+}
+
+// silu(w1 x) * (w3 x) of batch vectors (x: batch,n) from the tiles [begin,
+// end) of w1 and w3 into hb (batch,d), a tile of both at a time
+static void ffn_tiles(float *hb, const Projection *w1, const Projection *w3,
+                      const float *x, const int8_t *xq, const float *xs,
+                      int batch, int begin, int end) {
+  const int d = w1->d;
+  for (int t = begin; t < end; t++) {
+    const int i = t * MATMUL_ROWS;
+    const int rows = d - i < MATMUL_ROWS ? d - i : MATMUL_ROWS;
+    const Tile tile[2] = {{w1, i}, {w3, i}};
+    for (int b = 0; b < batch; b++) {
+      float h[2 * MATMUL_ROWS];
+      tiles_dot(h, tile, 2, x, xq, xs, b);
+      // SwiGLU non-linearity, silu(x)=x*σ(x) with σ the logistic sigmoid
+      for (int r = 0; r < rows; r++) {
+        float val = h[r];
+        val *= (1.0f / (1.0f + expf(-val)));
+        hb[(size_t)b * d + i + r] = val * h[MATMUL_ROWS + r];
+      }
+    }
+  }
+}
+
+// the float projections of the same shape multiplied with x (n,) into out
+// (count,d), a tile of each at a time
+static void matmul_fused(float *out, const float *x, const Projection *proj,
+                         int count) {
+  const int d = proj[0].d;
+  for (int i = 0; i < d; i += MATMUL_ROWS) {
+    const int rows = d - i < MATMUL_ROWS ? d - i : MATMUL_ROWS;
+    Tile tile[FUSED_TILES];
+    float val[FUSED_TILES * MATMUL_ROWS];
+    for (int m = 0; m < count; m++) {
+      tile[m] = (Tile){&proj[m], i};
+    }
+    tiles_dot(val, tile, count, x, NULL, NULL, 0);
+    for (int m = 0; m < count; m++) {
+      memcpy(out + (size_t)m * d + i, val + m * MATMUL_ROWS,
+             rows * sizeof(float));
+    }
+  }
+}
+
+void gemv_bench(int n, int d, int fused, GemvBench *result) {
+  select_dot_rows();
+  float *w = malloc((size_t)fused * d * n * sizeof(float));
+  float *x = malloc(n * sizeof(float));
+  float *out = malloc((size_t)fused * d * sizeof(float));
+  float *packed_out = malloc(d * sizeof(float));
+  float *fused_out = malloc((size_t)fused * d * sizeof(float));
+  if (!w || !x || !out || !packed_out || !fused_out) {
+    fprintf(stderr, "malloc failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < (size_t)fused * d * n; i++) {
+    w[i] = (float)rand() / RAND_MAX - 0.5f;
+  }
+  for (int j = 0; j < n; j++) {
+    x[j] = (float)rand() / RAND_MAX - 0.5f;
+  }
+  PackedTensor t;
+  pack_tensor(&t, w, 1, n, d);
+  // the matrices multiplied with the same x, a tile of each at a time
+  Projection proj[FUSED_TILES];
+  for (int m = 0; m < fused; m++) {
+    proj[m] = (Projection){w + (size_t)m * d * n, NULL, 0, n, d};
+  }
+
+  // the layouts take turns in rounds of about 256 MB of weights, after a
+  // dry run, and the fastest round of each counts
+  const int calls =
+      1 + (int)((1 << 28) / ((size_t)fused * d * n * sizeof(float)));
+  matmul_rows(out, x, w, n, d, 1, 0, d);
+  matmul_panels(packed_out, x, t.panels, n, d, 1, 0, d);
+  if (fused > 1) {
+    matmul_fused(fused_out, x, proj, fused);
+  }
+  result->ms = INFINITY;
+  result->packed_ms = INFINITY;
+  result->separate_ms = INFINITY;
+  result->fused_ms = INFINITY;
+  for (int round = 0; round < 8; round++) {
+    double start = bench_ms();
+    for (int i = 0; i < calls; i++) {
+      matmul_rows(out, x, w, n, d, 1, 0, d);
+    }
+    result->ms = fmin(result->ms, (bench_ms() - start) / calls);
+    start = bench_ms();
+    for (int i = 0; i < calls; i++) {
+      matmul_panels(packed_out, x, t.panels, n, d, 1, 0, d);
+    }
+    result->packed_ms = fmin(result->packed_ms, (bench_ms() - start) / calls);
+    if (fused < 2) {
+      continue;
+    }
+    start = bench_ms();
+    for (int i = 0; i < calls; i++) {
+      for (int m = 0; m < fused; m++) {
+        matmul_rows(out + (size_t)m * d, x, proj[m].w, n, d, 1, 0, d);
+      }
+    }
+    result->separate_ms =
+        fmin(result->separate_ms, (bench_ms() - start) / calls);
+    start = bench_ms();
+    for (int i = 0; i < calls; i++) {
+      matmul_fused(fused_out, x, proj, fused);
+    }
+    result->fused_ms = fmin(result->fused_ms, (bench_ms() - start) / calls);
+  }
+
+  result->error = 0.0f;
+  for (int i = 0; i < d; i++) {
+    result->error = fmaxf(result->error, fabsf(out[i] - packed_out[i]));
+  }
+  for (int i = 0; fused > 1 && i < fused * d; i++) {
+    result->error = fmaxf(result->error, fabsf(out[i] - fused_out[i]));
+  }
+  free(t.panels);
+  free(w);
+  free(x);
+  free(out);
+  free(packed_out);
+  free(fused_out);
+}
+
+struct TokenJob {
+  Transformer *transformer;
+  int token;
+  int pos;
+  bool with_logits;
+  int stride; // of the quantized inputs of every thread on the q8 path
+};
+
+// rows [begin, end) of matrix l of w, or of its int8 version qw on the q8
+// path, times x (n,) -> xout (d,). x was quantized into xq and xs for q8.
+static void token_rows(float *xout, float *x, const int8_t *xq,
+                       const float *xs, float *w, const QTensor *qw, size_t l,
+                       int n, int d, int begin, int end) {
+  if (qw) {
+    matmul_rows_q8(xout, xq, xs, qw, l * d, n, d, 1, begin, end);
+  } else {
+    matmul_rows(xout, x, w + l * n * d, n, d, 1, begin, end);
+  }
+}
+
+// forward_token() on one thread of the pool. the threads split the rows of
+// every matmul and the heads, the rmsnorms are left to thread 0, and each
+// step waits for the previous one in a barrier. on the q8 path every thread
+// quantizes the input of a matmul itself, it's cheaper than another barrier.
+static void forward_token_thread(void *arg, int thread) {
+  const struct TokenJob *job = arg;
   // a few convenience variables
-  Config *p = &transformer->config;
-  TransformerWeights *w = &transformer->weights;
-  RunState *s = &transformer->state;
+  Config *p = &job->transformer->config;
+  TransformerWeights *w = &job->transformer->weights;
+  RunState *s = &job->transformer->state;
+  const int pos = job->pos;
+  const int n_threads = pool.n_threads;
   float *x = s->x;
   int dim = p->dim;
   int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
@@ -72,53 +1504,54 @@ float *forward_cpu(Transformer *transformer, int token, int pos) {
       p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
   int hidden_dim = p->hidden_dim;
   int head_size = dim / p->n_heads;
+  int begin, end;
+  const bool use_q8 = job->transformer->cpu_q8;
+  const int group_size = q8.group_size;
+  int8_t *xq = use_q8 ? q8.xq + (size_t)thread * job->stride : NULL;
+  float *xs = use_q8 ? q8.xs + (size_t)thread * job->stride / group_size : NULL;
 
   // copy the token embedding into x
-  float *content_row = w->token_embedding_table + token * dim;
-  memcpy(x, content_row, dim * sizeof(*x));
+  if (thread == 0) {
+    float *content_row = w->token_embedding_table + job->token * dim;
+    memcpy(x, content_row, dim * sizeof(*x));
+  }
 
   // forward all the layers
   for (unsigned long long l = 0; l < p->n_layers; l++) {
 
     // attention rmsnorm
-    rmsnorm(s->xb, x, w->rms_att_weight + l * dim, dim);
+    if (thread == 0) {
+      rmsnorm(s->xb, x, w->rms_att_weight + l * dim, dim);
+    }
+    pool_barrier();
 
     // key and value point to the kv cache
     int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
-    s->k = s->key_cache + loff + pos * kv_dim;
-    s->v = s->value_cache + loff + pos * kv_dim;
-
-    // qkv matmuls for this position
-    matmul(s->q, s->xb, w->wq + l * dim * dim, dim, dim);
-    matmul(s->k, s->xb, w->wk + l * dim * kv_dim, dim, kv_dim);
-    matmul(s->v, s->xb, w->wv + l * dim * kv_dim, dim, kv_dim);
-
-    // RoPE relative positional encoding: complex-valued rotate q and k in each
-    // head
-    for (int i = 0; i < dim; i += 2) {
-      int head_dim = i % head_size;
-      float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
-      float val = pos * freq;
-      float fcr = cosf(val);
-      float fci = sinf(val);
-
-      float v0 = s->q[i];
-      float v1 = s->q[i + 1];
-      s->q[i] = v0 * fcr - v1 * fci;
-      s->q[i + 1] = v0 * fci + v1 * fcr;
-
-      if (i < kv_dim) {
-        float v0 = s->k[i];
-        float v1 = s->k[i + 1];
-        s->k[i] = v0 * fcr - v1 * fci;
-        s->k[i + 1] = v0 * fci + v1 * fcr;
-      }
-    }
-
-    // multihead attention. iterate over all heads
-    size_t h;
-#pragma omp parallel for private(h)
-    for (h = 0; h < p->n_heads; h++) {
+    float *k = s->key_cache + loff + pos * kv_dim;
+    float *v = s->value_cache + loff + pos * kv_dim;
+
+    // qkv matmuls for this position, fused. the threads split the tiles of
+    // wq, wk and wv one after the other
+    if (use_q8) {
+      quantize(xq, xs, s->xb, dim, group_size);
+    }
+    const Projection qkv[3] = {
+        {w->wq, use_q8 ? &q8.wq : NULL, l, dim, dim},
+        {w->wk, use_q8 ? &q8.wk : NULL, l, dim, kv_dim},
+        {w->wv, use_q8 ? &q8.wv : NULL, l, dim, kv_dim},
+    };
+    float *qkv_out[3] = {s->q, k, v};
+    thread_tiles(tiles(dim) + 2 * tiles(kv_dim), thread, &begin, &end);
+    qkv_tiles(qkv_out, qkv, s->xb, xq, xs, s->rope + pos * head_size,
+              head_size, 1, begin, end);
+    pool_barrier();
+
+    if (!job->with_logits && l == p->n_layers - 1) {
+      return;
+    }
+
+    // multihead attention. iterate over the heads of this thread
+    for (int h = thread; h < (int)p->n_heads; h += n_threads) {
       // get the query vector for this head
       float *q = s->q + h * head_size;
 
@@ -161,46 +1594,304 @@ float *forward_cpu(Transformer *transformer, int token, int pos) {
         }
       }
     }
+    pool_barrier();
 
-    // final matmul to get the output of the attention
-    matmul(s->xb2, s->xb, w->wo + l * dim * dim, dim, dim);
-
-    // residual connection back into x
-    for (int i = 0; i < dim; i++) {
+    // final matmul to get the output of the attention, residual connection
+    // back into x
+    if (use_q8) {
+      quantize(xq, xs, s->xb, dim, group_size);
+    }
+    thread_rows(dim, thread, &begin, &end);
+    token_rows(s->xb2, s->xb, xq, xs, w->wo, use_q8 ? &q8.wo : NULL, l, dim,
+               dim, begin, end);
+    for (int i = begin; i < end; i++) {
       x[i] += s->xb2[i];
     }
+    pool_barrier();
 
     // ffn rmsnorm
-    rmsnorm(s->xb, x, w->rms_ffn_weight + l * dim, dim);
+    if (thread == 0) {
+      rmsnorm(s->xb, x, w->rms_ffn_weight + l * dim, dim);
+    }
+    pool_barrier();
 
     // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-    // first calculate self.w1(x) and self.w3(x)
-    matmul(s->hb, s->xb, w->w1 + l * dim * hidden_dim, dim, hidden_dim);
-    matmul(s->hb2, s->xb, w->w3 + l * dim * hidden_dim, dim, hidden_dim);
-
-    // SwiGLU non-linearity
-    for (int i = 0; i < hidden_dim; i++) {
-      float val = s->hb[i];
-      // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
-      val *= (1.0f / (1.0f + expf(-val)));
-      // elementwise multiply with w3(x)
-      val *= s->hb2[i];
-      s->hb[i] = val;
+    // self.w1(x) and self.w3(x) fused, a tile of both at a time
+    if (use_q8) {
+      quantize(xq, xs, s->xb, dim, group_size);
     }
+    const Projection w1 = {w->w1, use_q8 ? &q8.w1 : NULL, l, dim, hidden_dim};
+    const Projection w3 = {w->w3, use_q8 ? &q8.w3 : NULL, l, dim, hidden_dim};
+    thread_tiles(tiles(hidden_dim), thread, &begin, &end);
+    ffn_tiles(s->hb, &w1, &w3, s->xb, xq, xs, 1, begin, end);
+    pool_barrier();
 
-    // final matmul to get the output of the ffn
-    matmul(s->xb, s->hb, w->w2 + l * dim * hidden_dim, hidden_dim, dim);
-
-    // residual connection
-    for (int i = 0; i < dim; i++) {
+    // final matmul to get the output of the ffn, residual connection
+    if (use_q8) {
+      quantize(xq, xs, s->hb, hidden_dim, group_size);
+    }
+    thread_rows(dim, thread, &begin, &end);
+    token_rows(s->xb, s->hb, xq, xs, w->w2, use_q8 ? &q8.w2 : NULL, l,
+               hidden_dim, dim, begin, end);
+    for (int i = begin; i < end; i++) {
       x[i] += s->xb[i];
     }
+    pool_barrier();
   }
 
   // final rmsnorm
-  rmsnorm(x, x, w->rms_final_weight, dim);
+  if (thread == 0) {
+    rmsnorm(x, x, w->rms_final_weight, dim);
+  }
+  pool_barrier();
 
   // classifier into logits
-  matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+  if (use_q8) {
+    quantize(xq, xs, x, dim, group_size);
+  }
+  thread_rows(p->vocab_size, thread, &begin, &end);
+  token_rows(s->logits, x, xq, xs, w->wcls, use_q8 ? &q8.wcls : NULL, 0, dim,
+             p->vocab_size, begin, end);
+}
+
+// without logits the token is done once the last layer has written its k and v
+// into the cache
+static float *forward_token(Transformer *transformer, int token, int pos,
+                            bool with_logits) {
+  start_pool(transformer->cpu_threads);
+  select_dot_rows();
+  if (transformer->cpu_packed) {
+    start_packed(transformer);
+  }
+  const Config *p = &transformer->config;
+  int stride = p->hidden_dim > p->dim ? p->hidden_dim : p->dim;
+  if (transformer->cpu_q8) {
+    start_q8(transformer);
+    reserve_q8_inputs((size_t)pool.n_threads * stride);
+  }
+  struct TokenJob job = {transformer, token, pos, with_logits, stride};
+  pool_run(forward_token_thread, &job);
+  return with_logits ? transformer->state.logits : NULL;
+}
+
+float *forward_cpu(Transformer *transformer, int token, int pos) {
+  return forward_token(transformer, token, pos, true);
+}
+
+void forward_kv_cpu(Transformer *transformer, int token, int pos) {
+  forward_token(transformer, token, pos, false);
+}
+
+struct PrefillHeadsJob {
+  const Config *p;
+  RunState *s;
+  const float *q;
+  float *xb;
+  int loff; // kv cache layer offset
+  int t0;   // first token of the block finishing the layer
+  int n;    // tokens of the block
+  int pos;  // of the first one
+};
+
+static void prefill_heads_thread(void *arg, int thread) {
+  const struct PrefillHeadsJob *job = arg;
+  const Config *p = job->p;
+  RunState *s = job->s;
+  int dim = p->dim;
+  int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+  int kv_mul = p->n_heads / p->n_kv_heads;
+  int head_size = dim / p->n_heads;
+  int loff = job->loff;
+
+  for (int h = thread; h < (int)p->n_heads; h += pool.n_threads) {
+    float *att = s->att + h * p->seq_len;
+    for (int t = job->t0; t < job->n; t++) {
+      const float *qt = job->q + t * dim + h * head_size;
+      int end = job->pos + t;
+
+      for (int i = 0; i <= end; i++) {
+        float *kc = s->key_cache + loff + i * kv_dim + (h / kv_mul) * head_size;
+        float score = 0.0f;
+        for (int j = 0; j < head_size; j++) {
+          score += qt[j] * kc[j];
+        }
+        att[i] = score / sqrtf(head_size);
+      }
+      softmax(att, end + 1);
+
+      // weighted sum of the values, store back into xb
+      float *out = job->xb + t * dim + h * head_size;
+      memset(out, 0, head_size * sizeof(float));
+      for (int i = 0; i <= end; i++) {
+        float *vc =
+            s->value_cache + loff + i * kv_dim + (h / kv_mul) * head_size;
+        for (int j = 0; j < head_size; j++) {
+          out[j] += att[i] * vc[j];
+        }
+      }
+    }
+  }
+}
+
+// the fused projections of a block of tokens over the pool, the threads split
+// the tiles
+struct FusedJob {
+  Projection proj[3]; // wq, wk, wv or w1, w3
+  float *out[3];
+  const float *x;
+  const int8_t *xq;
+  const float *xs;
+  const float *rope; // of the first token for qkv, NULL for the ffn
+  int head_size;
+  int batch;
+};
+
+static void fused_thread(void *arg, int thread) {
+  const struct FusedJob *job = arg;
+  int begin, end;
+  if (job->rope) {
+    thread_tiles(tiles(job->proj[0].d) + 2 * tiles(job->proj[1].d), thread,
+                 &begin, &end);
+    qkv_tiles(job->out, job->proj, job->x, job->xq, job->xs, job->rope,
+              job->head_size, job->batch, begin, end);
+  } else {
+    thread_tiles(tiles(job->proj[0].d), thread, &begin, &end);
+    ffn_tiles(job->out[0], &job->proj[0], &job->proj[1], job->x, job->xq,
+              job->xs, job->batch, begin, end);
+  }
+}
+
+// runs the job, with its input quantized first on the q8 path
+static void run_fused(struct FusedJob *job) {
+  job->xq = NULL;
+  job->xs = NULL;
+  if (job->proj[0].qw) {
+    const size_t size = (size_t)job->batch * job->proj[0].n;
+    reserve_q8_inputs(size);
+    quantize(q8.xq, q8.xs, job->x, size, q8.group_size);
+    job->xq = q8.xq;
+    job->xs = q8.xs;
+  }
+  pool_run(fused_thread, job);
+}
+
+float *forward_prefill_cpu(Transformer *transformer, const int *tokens,
+                           int n_tokens, int pos) {
+  start_pool(transformer->cpu_threads);
+  select_dot_rows();
+  const bool use_q8 = transformer->cpu_q8;
+  if (use_q8) {
+    start_q8(transformer);
+  }
+  if (transformer->cpu_packed) {
+    start_packed(transformer);
+  }
+  // a few convenience variables
+  Config *p = &transformer->config;
+  TransformerWeights *w = &transformer->weights;
+  RunState *s = &transformer->state;
+  int dim = p->dim;
+  int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+  int hidden_dim = p->hidden_dim;
+  int head_size = dim / p->n_heads;
+  int n = n_tokens;
+
+  // activations of the whole block, one row per token
+  float *x = malloc((size_t)n * dim * sizeof(float));
+  float *xb = malloc((size_t)n * dim * sizeof(float));
+  float *xb2 = malloc((size_t)n * dim * sizeof(float));
+  float *q = malloc((size_t)n * dim * sizeof(float));
+  float *hb = malloc((size_t)n * hidden_dim * sizeof(float));
+  if (!x || !xb || !xb2 || !q || !hb) {
+    fprintf(stderr, "malloc failed!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // copy the token embeddings into x
+  for (int t = 0; t < n; t++) {
+    memcpy(x + t * dim, w->token_embedding_table + tokens[t] * dim,
+           dim * sizeof(*x));
+  }
+
+  // forward all the layers
+  for (unsigned long long l = 0; l < p->n_layers; l++) {
+
+    // attention rmsnorm
+    for (int t = 0; t < n; t++) {
+      rmsnorm(xb + t * dim, x + t * dim, w->rms_att_weight + l * dim, dim);
+    }
+
+    // the positions of the block are consecutive, so k and v go straight into
+    // the kv cache
+    int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
+    float *k = s->key_cache + loff + pos * kv_dim;
+    float *v = s->value_cache + loff + pos * kv_dim;
+
+    // qkv matmuls for all positions, fused and rotated by RoPE
+    struct FusedJob qkv = {
+        .proj = {{w->wq, use_q8 ? &q8.wq : NULL, l, dim, dim},
+                 {w->wk, use_q8 ? &q8.wk : NULL, l, dim, kv_dim},
+                 {w->wv, use_q8 ? &q8.wv : NULL, l, dim, kv_dim}},
+        .out = {q, k, v},
+        .x = xb,
+        .rope = s->rope + pos * head_size,
+        .head_size = head_size,
+        .batch = n,
+    };
+    run_fused(&qkv);
+
+    // the last layer only has to finish the last position, the others are
+    // done once their k and v are in the cache
+    int t0 = l == p->n_layers - 1 ? n - 1 : 0;
+    int rest = n - t0;
+
+    // causal multihead attention, token t of the block attends to every
+    // position up to its own. the heads are split over the pool
+    struct PrefillHeadsJob heads = {p, s, q, xb, loff, t0, n, pos};
+    pool_run(prefill_heads_thread, &heads);
+
+    // final matmul to get the output of the attention, residual connection
+    // back into x
+    float *xt = x + t0 * dim;
+    float *xbt = xb + t0 * dim;
+    matmul_layer(xb2, xbt, w->wo, use_q8 ? &q8.wo : NULL, l, dim, dim, rest);
+    for (int i = 0; i < rest * dim; i++) {
+      xt[i] += xb2[i];
+    }
+
+    // ffn rmsnorm
+    for (int t = 0; t < rest; t++) {
+      rmsnorm(xbt + t * dim, xt + t * dim, w->rms_ffn_weight + l * dim, dim);
+    }
+
+    // self.w2(F.silu(self.w1(x)) * self.w3(x)) for all positions, w1 and w3
+    // fused
+    struct FusedJob ffn = {
+        .proj = {{w->w1, use_q8 ? &q8.w1 : NULL, l, dim, hidden_dim},
+                 {w->w3, use_q8 ? &q8.w3 : NULL, l, dim, hidden_dim}},
+        .out = {hb},
+        .x = xbt,
+        .batch = rest,
+    };
+    run_fused(&ffn);
+    matmul_layer(xbt, hb, w->w2, use_q8 ? &q8.w2 : NULL, l, hidden_dim, dim,
+                 rest);
+
+    // residual connection
+    for (int i = 0; i < rest * dim; i++) {
+      xt[i] += xbt[i];
+    }
+  }
+
+  // only the last position needs logits
+  rmsnorm(s->x, x + (n - 1) * dim, w->rms_final_weight, dim);
+  matmul_layer(s->logits, s->x, w->wcls, use_q8 ? &q8.wcls : NULL, 0, dim,
+               p->vocab_size, 1);
+
+  free(x);
+  free(xb);
+  free(xb2);
+  free(q);
+  free(hb);
   return s->logits;
 }
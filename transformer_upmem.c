@@ -1,8 +1,10 @@
 #include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "dpu.h"
 #include "dpu_types.h"
@@ -29,18 +31,499 @@ static uint8_t mha_prog[] = {
 static uint8_t qkv_prog[] = {
 #embed "build/qkv.kernel"
 };
-static uint8_t rmsnorm_prog[] = {
-#embed "build/rmsnorm.kernel"
+static uint8_t attout_q8_prog[] = {
+#embed "build/attout_q8.kernel"
+};
+static uint8_t cls_q8_prog[] = {
+#embed "build/cls_q8.kernel"
+};
+static uint8_t ffn1_q8_prog[] = {
+#embed "build/ffn1_q8.kernel"
+};
+static uint8_t ffn2_q8_prog[] = {
+#embed "build/ffn2_q8.kernel"
+};
+static uint8_t qkv_q8_prog[] = {
+#embed "build/qkv_q8.kernel"
 };
 
 #define load_dpu_kernel(dpu_set, name)                                         \
-  dpu_load_from_memory(dpu_set, name##_prog, sizeof(name##_prog), nullptr)
+  (stats.program_loads++,                                                      \
+   dpu_load_from_memory(dpu_set, name##_prog, sizeof(name##_prog), nullptr))
 #else
 
 #define load_dpu_kernel(dpu_set, name)                                         \
-  dpu_load(dpu_set, "build/" #name ".kernel", nullptr)
+  (stats.program_loads++, dpu_load(dpu_set, "build/" #name ".kernel", nullptr))
 #endif
 
+// the matvec stages are builds of kernels/gemv.c, in a float and a q8 version
+#define load_matvec_kernel(dpu_set, name)                                      \
+  (group_size > 0 ? load_dpu_kernel(dpu_set, name##_q8)                        \
+                  : load_dpu_kernel(dpu_set, name))
+
+// a group of consecutive layers with a dpu set per stage, holding the
+// weights and kv cache of its layers. the layers are split into
+// transformer->upmem_groups groups, the last one also classifies.
+struct DpuSets {
+  struct dpu_set_t qkv;
+  struct dpu_set_t mha;
+  struct dpu_set_t cls;
+  struct dpu_set_t ffn1;
+  struct dpu_set_t ffn2;
+  struct dpu_set_t attnout;
+  // rows of the stage's matrices on each of its dpus, see plan_partition()
+  uint32_t qkv_rows;
+  uint32_t attnout_rows;
+  uint32_t ffn1_rows;
+  uint32_t ffn2_rows;
+  uint32_t cls_rows;
+  uint32_t first_layer; // the group's layers of the model
+  uint32_t n_layers;
+  bool last; // holds the classifier
+};
+
+// mram layout of a matvec stage as the Makefile specializes kernels/gemv.c,
+// every matrix and output of a stage has a slot of the largest size
+struct Gemv {
+  uint32_t max_rows;   // GEMV_ROWS
+  uint32_t max_cols;   // GEMV_COLS
+  uint32_t max_layers; // GEMV_LAYERS
+};
+
+static const struct Gemv qkv_gemv = {QKV_MAX_ROWS, MAX_DIM, MAX_N_LAYERS};
+static const struct Gemv attout_gemv = {ATTOUT_MAX_ROWS, MAX_DIM,
+                                        MAX_N_LAYERS};
+static const struct Gemv ffn1_gemv = {FFN1_MAX_ROWS, MAX_DIM, MAX_N_LAYERS};
+static const struct Gemv ffn2_gemv = {FFN2_MAX_ROWS, MAX_HIDDEN_DIM,
+                                      MAX_N_LAYERS};
+static const struct Gemv cls_gemv = {CLS_MAX_ROWS, MAX_DIM, 1};
+
+// layer groups of the current plan, allocated by the first forward
+static struct DpuSets *groups = nullptr;
+static uint32_t n_groups = 0;
+static uint32_t nr_ranks_used = 0;
+
+// host <-> dpu traffic, to verify that a token only moves activations
+static struct {
+  size_t tokens;
+  size_t resident_bytes;   // weight bytes sharded into mram at startup
+  size_t activation_bytes; // bytes moved while decoding
+  size_t launches;         // of a dpu set while decoding
+  size_t transfers_to;     // host -> dpu transfers while decoding
+  size_t transfers_from;   // dpu -> host
+  size_t program_loads;    // programs loaded into iram, including startup
+  size_t startup_loads;    // programs loaded before the first token
+  double wall_ms;          // time spent decoding
+  double overlap_ms;       // host work done while dpus were running
+  size_t queued;           // launches queued in async mode
+  double wait_ms;          // host blocked on running dpus
+} stats;
+
+// in async mode launches and transfers are queued on the dpu sets, the host
+// only blocks in sync_dpus() once it needs the results of a stage
+static bool async = false;
+// start of the async launch the host hasn't waited for yet
+static double launched_at = -1.0;
+// weights per scale of the q8 weights on the dpus, 0 for float weights
+static int group_size = 0;
+
+static double now_ms(void) {
+  struct timespec time;
+  timespec_get(&time, TIME_UTC);
+  return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+static uint32_t nr_dpus(struct dpu_set_t dpu_set) {
+  uint32_t n = 0;
+  DPU_ASSERT(dpu_get_nr_dpus(dpu_set, &n));
+  return n;
+}
+
+static void launch(struct dpu_set_t dpu_set) {
+  stats.launches++;
+  if (async) {
+    DPU_ASSERT(dpu_launch(dpu_set, DPU_ASYNCHRONOUS));
+    launched_at = now_ms();
+    stats.queued++;
+  } else {
+    const double start = now_ms();
+    DPU_ASSERT(dpu_launch(dpu_set, DPU_SYNCHRONOUS));
+    stats.wait_ms += now_ms() - start;
+  }
+}
+
+// waits for everything queued on the set. whatever the host did since the
+// launch overlapped with the running dpus.
+static void sync_dpus(struct dpu_set_t dpu_set) {
+  if (!async) {
+    return;
+  }
+  const double start = now_ms();
+  if (launched_at >= 0.0) {
+    stats.overlap_ms += start - launched_at;
+    launched_at = -1.0;
+  }
+  DPU_ASSERT(dpu_sync(dpu_set));
+  stats.wait_ms += now_ms() - start;
+}
+
+static void push_xfer(struct dpu_set_t dpu_set, dpu_xfer_t xfer,
+                      const char *symbol, uint32_t offset, size_t length) {
+  DPU_ASSERT(dpu_push_xfer(dpu_set, xfer, symbol, offset, length,
+                           async ? DPU_XFER_ASYNC : DPU_XFER_DEFAULT));
+  stats.activation_bytes += nr_dpus(dpu_set) * length;
+  if (xfer == DPU_XFER_TO_DPU) {
+    stats.transfers_to++;
+  } else {
+    stats.transfers_from++;
+  }
+}
+
+static void broadcast_to(struct dpu_set_t dpu_set, const char *symbol,
+                         uint32_t offset, const void *src, size_t length) {
+  DPU_ASSERT(dpu_broadcast_to(dpu_set, symbol, offset, src, length,
+                              async ? DPU_XFER_ASYNC : DPU_XFER_DEFAULT));
+  stats.activation_bytes += nr_dpus(dpu_set) * length;
+  stats.transfers_to++;
+}
+
+// the kernels read the model dimensions at runtime, but their mram arrays are
+// sized for a range of models and they split vectors evenly into tasklets
+static void check_config(const Config *p) {
+  const int head_size = p->dim / p->n_heads;
+  const char *error = nullptr;
+  if (p->n_kv_heads == 0 || p->n_heads % p->n_kv_heads != 0) {
+    error = "query heads don't split evenly over the kv heads";
+  } else if (p->dim > MAX_DIM || p->hidden_dim > MAX_HIDDEN_DIM ||
+             p->n_layers > MAX_N_LAYERS || head_size > MAX_HEAD_SIZE ||
+             p->seq_len > MAX_SEQ_LEN) {
+    error = "model exceeds the mram capacity of the kernels";
+  } else if (p->dim % 32 != 0 || p->hidden_dim % 32 != 0 ||
+             p->vocab_size % 32 != 0 || head_size % 2 != 0 ||
+             p->seq_len % 2 != 0) {
+    error = "model dimensions don't split evenly into tasklets";
+  } else if (group_size > 0 &&
+             (group_size < 32 || group_size % 8 != 0 ||
+              p->dim % group_size != 0 || p->hidden_dim % group_size != 0)) {
+    error = "q8 group size has to be a multiple of 8 of at least 32 that "
+            "divides dim and hidden_dim";
+  }
+  if (error) {
+    fprintf(stderr, "upmem: %s\n", error);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// largest divisor of total up to max that is a multiple of step, 0 if there
+// is none
+static uint32_t divisor(uint32_t total, uint32_t max, uint32_t step) {
+  for (uint32_t r = max / step * step; r >= step; r -= step) {
+    if (total % r == 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+static uint32_t ranks_for(uint32_t n, uint32_t rank_size) {
+  return (n + rank_size - 1) / rank_size;
+}
+
+// a matvec stage splits the rows of its matrices evenly over its dpus
+struct Stage {
+  uint32_t total_rows; // rows of one of its matrices
+  uint32_t max_rows;   // rows per dpu its mram holds
+  double row_cost;     // weights per row read for a token, over all layers
+  uint32_t copies;     // sets of the stage, one per layer group
+  uint32_t step;       // rows per dpu are a multiple of it
+  uint32_t *rows;      // rows per dpu of the plan
+};
+
+// splits every stage over as many dpus as the ranks allow. dpu sets are
+// allocated in whole ranks and every stage has its own set, so the stages
+// start at their fewest dpus and the one taking longest gets more as long as
+// its ranks fit, its tasklets each keep a pair of rows and its rows split
+// evenly. a qkv dpu has the k and v rows of the query heads of its q rows, so
+// those have to be a multiple of kv_mul pairs. the mha dpus keep one kv head
+// each. every layer group gets the same plan for its own sets, only the
+// classifier exists once. returns the ranks of the plan, 0 if the model
+// doesn't fit into nr_ranks.
+static uint32_t plan_partition(struct DpuSets *plan, const Config *p,
+                               uint32_t groups, uint32_t nr_ranks,
+                               uint32_t rank_size) {
+  const double layers = p->n_layers / groups;
+  const uint32_t kv_mul = p->n_heads / p->n_kv_heads;
+  struct Stage stages[] = {
+      {p->dim, QKV_MAX_ROWS, (1.0 + 2.0 / kv_mul) * p->dim * layers, groups,
+       2 * kv_mul, &plan->qkv_rows},
+      {p->dim, ATTOUT_MAX_ROWS, p->dim * layers, groups, 2,
+       &plan->attnout_rows},
+      {p->hidden_dim, FFN1_MAX_ROWS, 2.0 * p->dim * layers, groups, 2,
+       &plan->ffn1_rows},
+      {p->dim, FFN2_MAX_ROWS, p->hidden_dim * layers, groups, 2,
+       &plan->ffn2_rows},
+      {p->vocab_size, CLS_MAX_ROWS, p->dim, 1, 2, &plan->cls_rows},
+  };
+  const size_t n_stages = sizeof(stages) / sizeof(stages[0]);
+
+  uint32_t ranks = groups * ranks_for(p->n_kv_heads, rank_size);
+  for (size_t s = 0; s < n_stages; s++) {
+    const struct Stage *stage = &stages[s];
+    *stage->rows = divisor(stage->total_rows, stage->max_rows, stage->step);
+    if (*stage->rows == 0) {
+      return 0;
+    }
+    ranks +=
+        stage->copies * ranks_for(stage->total_rows / *stage->rows, rank_size);
+  }
+  if (ranks > nr_ranks) {
+    return 0;
+  }
+
+  for (;;) {
+    struct Stage *slowest = nullptr;
+    uint32_t slowest_rows = 0;
+    uint32_t slowest_ranks = 0;
+    for (size_t s = 0; s < n_stages; s++) {
+      const struct Stage *stage = &stages[s];
+      const uint32_t rows =
+          divisor(stage->total_rows, *stage->rows - 1, stage->step);
+      if (rows < MIN_ROWS_PER_DPU) {
+        continue;
+      }
+      const uint32_t more =
+          stage->copies *
+          (ranks_for(stage->total_rows / rows, rank_size) -
+           ranks_for(stage->total_rows / *stage->rows, rank_size));
+      if (ranks + more > nr_ranks) {
+        continue;
+      }
+      if (!slowest ||
+          *stage->rows * stage->row_cost > *slowest->rows * slowest->row_cost) {
+        slowest = &stages[s];
+        slowest_rows = rows;
+        slowest_ranks = more;
+      }
+    }
+    if (!slowest) {
+      return ranks;
+    }
+    *slowest->rows = slowest_rows;
+    ranks += slowest_ranks;
+  }
+}
+
+// ranks the planner may use, at most limit if it is positive, and the dpus
+// of the smallest one
+static void available_ranks(int limit, uint32_t *nr_ranks,
+                            uint32_t *rank_size) {
+  struct dpu_set_t all, rank;
+  DPU_ASSERT(dpu_alloc_ranks(DPU_ALLOCATE_ALL, getenv("UPMEM_PROFILE"), &all));
+  DPU_ASSERT(dpu_get_nr_ranks(all, nr_ranks));
+  *rank_size = UINT32_MAX;
+  DPU_RANK_FOREACH(all, rank) {
+    const uint32_t n = nr_dpus(rank);
+    if (n < *rank_size) {
+      *rank_size = n;
+    }
+  }
+  DPU_ASSERT(dpu_free(all));
+
+  if (limit > 0 && (uint32_t)limit < *nr_ranks) {
+    *nr_ranks = limit;
+  }
+}
+
+// written once at startup, every launch reads the dimensions from mram
+static void write_config(struct dpu_set_t dpu_set, const Config *p,
+                         uint32_t rows, uint32_t cols) {
+  ModelConfig config = {
+      .dim = p->dim,
+      .hidden_dim = p->hidden_dim,
+      .n_layers = p->n_layers,
+      .n_heads = p->n_heads,
+      .n_kv_heads = p->n_kv_heads,
+      .head_size = p->dim / p->n_heads,
+      .seq_len = p->seq_len,
+      .rows = rows,
+      .cols = cols,
+      .group_size = group_size,
+  };
+  size_t i = 0;
+  struct dpu_set_t dpu;
+  DPU_FOREACH(dpu_set, dpu, i) {
+    config.dpu = i;
+    DPU_ASSERT(dpu_copy_to(dpu, "config", 0, &config, sizeof(config)));
+  }
+}
+
+// copies `rows` consecutive rows of row_size bytes of every layer's matrix to
+// each dpu of the set. the dpus of a set cover a matrix exactly, layer l
+// starts at offset + l * rows * row_size in mram.
+static void shard_rows(struct dpu_set_t dpu_set, const char *symbol,
+                       size_t offset, const void *m, size_t layers,
+                       size_t rows, size_t row_size) {
+  const size_t layer_size = nr_dpus(dpu_set) * rows * row_size;
+
+  size_t i = 0;
+  struct dpu_set_t dpu;
+  for (size_t l = 0; l < layers; l++) {
+    DPU_FOREACH(dpu_set, dpu, i) {
+      dpu_prepare_xfer(dpu, (uint8_t *)m + l * layer_size +
+                                i * rows * row_size);
+    }
+    DPU_ASSERT(dpu_push_xfer(dpu_set, DPU_XFER_TO_DPU, symbol,
+                             offset + l * rows * row_size, rows * row_size,
+                             DPU_XFER_DEFAULT));
+  }
+  stats.resident_bytes += layers * layer_size;
+}
+
+// shards a float matrix into slot `slot` of the weights (w) of a matvec
+// stage, or its int8 weights and scales (w_s) for the q8 kernels. the scales
+// of a row are padded to an even count, so every row stays 8 byte aligned in
+// mram.
+static void shard_matrix(struct dpu_set_t dpu_set, const struct Gemv *gemv,
+                         size_t slot, float *m, size_t layers, size_t rows,
+                         size_t cols) {
+  const size_t slot_rows = gemv->max_layers * gemv->max_rows;
+  if (group_size == 0) {
+    shard_rows(dpu_set, "w", slot * slot_rows * gemv->max_cols * sizeof(float),
+               m, layers, rows, cols * sizeof(float));
+    return;
+  }
+
+  const size_t total_rows = layers * nr_dpus(dpu_set) * rows;
+  const size_t scales = (cols / group_size + 1) & ~1u;
+  int8_t *q = malloc(total_rows * cols);
+  float *s = calloc(total_rows * scales, sizeof(float));
+  for (size_t r = 0; r < total_rows; r++) {
+    quantize(q + r * cols, s + r * scales, m + r * cols, cols, group_size);
+  }
+
+  shard_rows(dpu_set, "w", slot * slot_rows * gemv->max_cols, q, layers, rows,
+             cols);
+  shard_rows(dpu_set, "w_s",
+             slot * slot_rows * MAX_SCALES(gemv->max_cols) * sizeof(float), s,
+             layers, rows, scales * sizeof(float));
+  free(q);
+  free(s);
+}
+
+// k and v rows of the qkv dpus, the kv heads are shared by n_heads /
+// n_kv_heads query heads each
+static uint32_t kv_rows(const Config *p, const struct DpuSets *dpus) {
+  return dpus->qkv_rows * p->n_kv_heads / p->n_heads;
+}
+
+// weights every dpu of the set needs in full, like the rmsnorm weights
+static void broadcast_weights(struct dpu_set_t dpu_set, const char *symbol,
+                              float *w, size_t size) {
+  DPU_ASSERT(dpu_broadcast_to(dpu_set, symbol, 0, w, size * sizeof(float),
+                              DPU_XFER_DEFAULT));
+  stats.resident_bytes += nr_dpus(dpu_set) * size * sizeof(float);
+}
+
+// the weights of the group's layers, which the kernels index from 0
+static void shard_weights(struct DpuSets *dpus, const TransformerWeights *w,
+                          const Config *p) {
+  const size_t dim = p->dim;
+  const size_t kv_dim = dim * p->n_kv_heads / p->n_heads;
+  const size_t hidden_dim = p->hidden_dim;
+  const size_t layers = dpus->n_layers;
+  const size_t first = dpus->first_layer;
+  shard_matrix(dpus->qkv, &qkv_gemv, 0, w->wq + first * dim * dim, layers,
+               dpus->qkv_rows, dim);
+  shard_matrix(dpus->qkv, &qkv_gemv, 1, w->wk + first * kv_dim * dim, layers,
+               kv_rows(p, dpus), dim);
+  shard_matrix(dpus->qkv, &qkv_gemv, 2, w->wv + first * kv_dim * dim, layers,
+               kv_rows(p, dpus), dim);
+  shard_matrix(dpus->attnout, &attout_gemv, 0, w->wo + first * dim * dim,
+               layers, dpus->attnout_rows, dim);
+  shard_matrix(dpus->ffn1, &ffn1_gemv, 0, w->w1 + first * hidden_dim * dim,
+               layers, dpus->ffn1_rows, dim);
+  shard_matrix(dpus->ffn1, &ffn1_gemv, 1, w->w3 + first * hidden_dim * dim,
+               layers, dpus->ffn1_rows, dim);
+  shard_matrix(dpus->ffn2, &ffn2_gemv, 0, w->w2 + first * dim * hidden_dim,
+               layers, dpus->ffn2_rows, hidden_dim);
+
+  // the rmsnorms are fused into the kernels consuming their output
+  broadcast_weights(dpus->qkv, "rms_w", w->rms_att_weight + first * dim,
+                    layers * dim);
+  broadcast_weights(dpus->ffn1, "rms_w", w->rms_ffn_weight + first * dim,
+                    layers * dim);
+
+  if (dpus->last) {
+    shard_matrix(dpus->cls, &cls_gemv, 0, w->wcls, 1, dpus->cls_rows, dim);
+    broadcast_weights(dpus->cls, "rms_w", w->rms_final_weight, dim);
+  }
+}
+
+// cycles of the last launch of a matvec stage, the dpus of a stage all have
+// the same rows so its first one stands for all
+static unsigned long long last_cycles(struct dpu_set_t dpu_set) {
+  struct dpu_set_t dpu;
+  uint64_t cycles = 0;
+  DPU_FOREACH(dpu_set, dpu) {
+    DPU_ASSERT(dpu_copy_from(dpu, "cycles", 0, &cycles, sizeof(cycles)));
+    break;
+  }
+  return cycles;
+}
+
+void print_upmem_stats(void) {
+  if (!groups || stats.tokens == 0) {
+    return;
+  }
+  const struct DpuSets *dpus = &groups[n_groups - 1];
+  fprintf(stderr,
+          "upmem: %u ranks, %u layer groups of dpus x rows: qkv %u x %u, "
+          "attnout %u x %u, ffn1 %u x %u, ffn2 %u x %u, mha %u kv heads, "
+          "cls %u x %u\n",
+          nr_ranks_used, n_groups, nr_dpus(dpus->qkv), dpus->qkv_rows,
+          nr_dpus(dpus->attnout), dpus->attnout_rows, nr_dpus(dpus->ffn1),
+          dpus->ffn1_rows, nr_dpus(dpus->ffn2), dpus->ffn2_rows,
+          nr_dpus(dpus->mha), nr_dpus(dpus->cls), dpus->cls_rows);
+  fprintf(stderr,
+          "upmem: cycles of the last launch: qkv %llu, attnout %llu, "
+          "ffn1 %llu, ffn2 %llu, cls %llu\n",
+          last_cycles(dpus->qkv), last_cycles(dpus->attnout),
+          last_cycles(dpus->ffn1), last_cycles(dpus->ffn2),
+          last_cycles(dpus->cls));
+  // weights never leave mram after startup, so everything moved per token is
+  // activations
+  fprintf(stderr, "upmem: %zu weight bytes resident in mram\n",
+          stats.resident_bytes);
+  fprintf(stderr, "upmem: %zu activation bytes/token\n",
+          stats.activation_bytes / stats.tokens);
+  // every transfer is a separate request to the driver, however small
+  fprintf(stderr,
+          "upmem: %f launches/token, %f transfers to and %f from the dpus "
+          "per launch\n",
+          stats.launches / (double)stats.tokens,
+          stats.transfers_to / (double)stats.launches,
+          stats.transfers_from / (double)stats.launches);
+  // every stage has its own dpu set, so this should stay at zero
+  fprintf(stderr, "upmem: %zu program loads at startup, %f loads/token\n",
+          stats.startup_loads,
+          (stats.program_loads - stats.startup_loads) / (double)stats.tokens);
+  const double wall_ms = stats.wall_ms / stats.tokens;
+  if (stats.queued == 0) {
+    fprintf(stderr, "upmem: %f ms/token (%f ms blocked on dpus)\n", wall_ms,
+            stats.wait_ms / stats.tokens);
+    return;
+  }
+  // every stage depends on the previous one, so what overlaps is the packing
+  // of the next stage's args and residuals, and in pipelined runs the stages
+  // of the other groups
+  const double overlap_ms = stats.overlap_ms / stats.tokens;
+  fprintf(stderr,
+          "upmem: %f ms/token, %f ms overlapped (%.1f%%), %f ms serialized "
+          "(%f ms blocked on dpus)\n",
+          wall_ms, overlap_ms, 100.0 * overlap_ms / wall_ms,
+          wall_ms - overlap_ms, stats.wait_ms / stats.tokens);
+}
+
 dpu_error_t dpu_log_read_all(struct dpu_set_t mha_dpus) {
   size_t i = 0;
   struct dpu_set_t dpu;
@@ -54,392 +537,1029 @@ dpu_error_t dpu_log_read_all(struct dpu_set_t mha_dpus) {
   return DPU_OK;
 }
 
-float *forward_upmem(Transformer *transformer, int token, int pos) {
-  // a few convenience variables
-  Config *p = &transformer->config;
-  RunState *s = &transformer->state;
-  int dim = p->dim;
-  int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-  int kv_mul =
-      p->n_heads /
-      p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
-  int hidden_dim = p->hidden_dim;
-  int head_size = dim / p->n_heads;
+// tokens the dpus can advance per launch, bounded by the wram the matvec
+// kernels share between the input vectors
+static int max_block(const Transformer *transformer) {
+  const Config *p = &transformer->config;
+  const bool q8 = transformer->group_size > 0 || transformer->upmem_q8;
+  // the widest input of the matvec kernels
+  const size_t n = p->hidden_dim > p->dim ? p->hidden_dim : p->dim;
+  size_t vector_size = n * sizeof(float);
+  if (q8) {
+    vector_size += n + MAX_SCALES(n) * sizeof(float);
+  }
 
-  const TransformerWeights *w = &transformer->weights;
-  static float *x, *xb, *hb, *att, *q, *kc, *vc, *tkc, *tvc, *logits;
-  static const int zero[2] = {0, 0};
-
-  static struct DpuSets {
-    struct dpu_set_t qkv;
-    struct dpu_set_t mha;
-    struct dpu_set_t cls;
-    struct dpu_set_t ffn1;
-    struct dpu_set_t ffn2;
-    struct dpu_set_t attnout;
-    struct dpu_set_t rmsnorm;
-  } *dpus = nullptr;
+  size_t block = MAX_BATCH;
+  if (BATCH_WRAM_BUDGET / vector_size < block) {
+    block = BATCH_WRAM_BUDGET / vector_size;
+  }
+  return block;
+}
 
-  size_t i = 0;
-  struct dpu_set_t dpu;
+static uint32_t nr_groups(const Transformer *transformer) {
+  return transformer->upmem_groups > 1 ? transformer->upmem_groups : 1;
+}
 
-  if (!dpus) {
-    const char *upmem_profile = getenv("UPMEM_PROFILE");
+// kv cache slots of the mha dpus, every group only caches its own layers
+static int kv_slots(const Transformer *transformer) {
+  const Config *p = &transformer->config;
+  const size_t cache_size = (size_t)p->n_layers / nr_groups(transformer) *
+                            p->seq_len * (p->dim / p->n_heads);
+  return KV_CACHE_SIZE / cache_size;
+}
 
-    dpus = malloc(sizeof(*dpus));
-    DPU_ASSERT(dpu_alloc(VOCAB_SIZE / 16 / CLS_ROWS_PER_THREAD, upmem_profile,
-                         &dpus->cls));
-    DPU_ASSERT(dpu_alloc(HIDDEN_DIM / 16 / 4, upmem_profile, &dpus->ffn1));
-    DPU_ASSERT(dpu_alloc(N_HEADS, upmem_profile, &dpus->mha));
-    DPU_ASSERT(dpu_alloc(DIM / (QKV_TASKLETS * 2), upmem_profile, &dpus->qkv));
-    DPU_ASSERT(dpu_alloc(1, upmem_profile, &dpus->rmsnorm));
+// independent sequences additionally need a kv cache slot each on the mha
+// dpus
+int upmem_max_batch(const Transformer *transformer) {
+  int batch = max_block(transformer);
+  if (kv_slots(transformer) < batch) {
+    batch = kv_slots(transformer);
+  }
+  return batch;
+}
 
-    dpus->attnout = dpus->ffn2 = dpus->qkv;
+// every block in flight in the pipeline has its own slots
+int upmem_pipeline_batch(const Transformer *transformer) {
+  int batch = max_block(transformer);
+  if (kv_slots(transformer) / (int)nr_groups(transformer) < batch) {
+    batch = kv_slots(transformer) / nr_groups(transformer);
+  }
+  return batch;
+}
 
-    load_dpu_kernel(dpus->cls, cls);
-    load_dpu_kernel(dpus->ffn1, ffn1);
-    load_dpu_kernel(dpus->mha, mha);
-    load_dpu_kernel(dpus->rmsnorm, rmsnorm);
+// the kernels take and return blocks of batch x rows floats per dpu, every
+// stride floats, while the host keeps batch x n vectors
+static void pack(float *blocks, size_t stride, const float *v, size_t n,
+                 size_t rows, size_t batch) {
+  for (size_t d = 0; d < n / rows; d++) {
+    for (size_t b = 0; b < batch; b++) {
+      memcpy(blocks + d * stride + b * rows, v + b * n + d * rows,
+             rows * sizeof(float));
+    }
+  }
+}
 
-    // weights don't change between layers, so we only load them once
-    DPU_FOREACH(dpus->cls, dpu, i) {
-      dpu_prepare_xfer(dpu, w->wcls + i * 16 * CLS_ROWS_PER_THREAD * DIM);
+static void unpack(float *v, const float *blocks, size_t stride, size_t n,
+                   size_t rows, size_t batch) {
+  for (size_t d = 0; d < n / rows; d++) {
+    for (size_t b = 0; b < batch; b++) {
+      memcpy(v + b * n + d * rows, blocks + d * stride + b * rows,
+             rows * sizeof(float));
     }
-    dpu_push_xfer(dpus->cls, DPU_XFER_TO_DPU, "wcls", 0,
-                  16 * CLS_ROWS_PER_THREAD * DIM * sizeof(float),
-                  DPU_XFER_DEFAULT);
-
-    x = malloc(DIM * sizeof(float));
-    xb = malloc(DIM * sizeof(float));
-    hb = malloc(HIDDEN_DIM * sizeof(float));
-    att = malloc(SEQ_LEN * N_HEADS * sizeof(float));
-    q = malloc(DIM * sizeof(float));
-    kc = malloc(N_LAYERS * SEQ_LEN * KV_DIM * sizeof(float));
-    vc = malloc(N_LAYERS * SEQ_LEN * KV_DIM * sizeof(float));
-    tkc = malloc(N_HEADS * SEQ_LEN * HEAD_SIZE * sizeof(float));
-    tvc = malloc(N_HEADS * HEAD_SIZE * SEQ_LEN * sizeof(float));
-    logits = malloc(VOCAB_SIZE * sizeof(float));
-  }
-
-  // copy the token embedding into x
-  float *content_row = w->token_embedding_table + token * DIM;
-  memcpy(x, content_row, DIM * sizeof(*x));
-  memcpy(s->x, content_row, dim * sizeof(*x));
-
-  // forward all the layers
-  for (size_t l = 0; l < N_LAYERS; l++) {
-    // key and value point to the kv cache
-    int loff = l * SEQ_LEN * KV_DIM; // kv cache layer offset for convenience
-    float *k = kc + loff + pos * KV_DIM;
-    float *v = vc + loff + pos * KV_DIM;
-
-    { // attention rmsnorm
-      dpu_broadcast_to(dpus->rmsnorm, "w", 0, w->rms_att_weight + l * DIM,
-                       DIM * sizeof(float), DPU_XFER_DEFAULT);
-      dpu_broadcast_to(dpus->rmsnorm, "x", 0, x, DIM * sizeof(float),
-                       DPU_XFER_DEFAULT);
-      dpu_broadcast_to(dpus->rmsnorm, "data", 0, &zero, 2 * sizeof(float),
-                       DPU_XFER_DEFAULT);
-
-      dpu_launch(dpus->rmsnorm, DPU_SYNCHRONOUS);
-
-      DPU_FOREACH(dpus->rmsnorm, dpu, i) { dpu_prepare_xfer(dpu, xb); }
-      dpu_push_xfer(dpus->rmsnorm, DPU_XFER_FROM_DPU, "x", 0,
-                    DIM * sizeof(float), DPU_XFER_DEFAULT);
+  }
+}
+
+// transfers size floats of every dpu of the set, one block after the other
+static void push_blocks(struct dpu_set_t dpu_set, dpu_xfer_t xfer,
+                        const char *symbol, float *blocks, size_t size) {
+  size_t i = 0;
+  struct dpu_set_t dpu;
+  DPU_FOREACH(dpu_set, dpu, i) {
+    dpu_prepare_xfer(dpu, blocks + i * size);
+  }
+  push_xfer(dpu_set, xfer, symbol, 0, size * sizeof(float));
+}
+
+// floats of the arguments at the start of a launch block
+#define ARGS_SIZE(type) (sizeof(type) / sizeof(float))
+
+// the launch block of a matvec stage holds the arguments and the input,
+// batch x n floats, which all dpus share, or for a stage adding to a
+// residual (batch x rows per dpu) also the dpu's part of it. the arguments
+// and the residual don't depend on the stage before, so they are packed
+// while it runs.
+static void gemv_prepare(struct dpu_set_t dpu_set, float *blocks,
+                         const GemvArgs *args, size_t n,
+                         const float *residual, size_t rows) {
+  const size_t batch = args->batch;
+  const size_t size = ARGS_SIZE(GemvArgs) + batch * n;
+  if (residual) {
+    const size_t n_dpus = nr_dpus(dpu_set);
+    const size_t stride = size + batch * rows;
+    for (size_t d = 0; d < n_dpus; d++) {
+      memcpy(blocks + d * stride, args, sizeof(*args));
     }
+    pack(blocks + size, stride, residual, n_dpus * rows, rows, batch);
+  } else {
+    memcpy(blocks, args, sizeof(*args));
+  }
+}
 
-    { // qkv matmuls & RoPE
-      struct {
-        uint32_t dpu;
-        uint32_t pos;
-      } data[DIM / (QKV_TASKLETS * 2)];
+// queues a launch of a matvec stage prepared by gemv_prepare() with a single
+// transfer each way, rows is 0 without a residual. the outputs of every dpu,
+// batch x out_rows floats, are read into out.
+static void gemv_launch(struct dpu_set_t dpu_set, float *blocks, size_t batch,
+                        const float *in, size_t n, size_t rows, float *out,
+                        size_t out_rows) {
+  const size_t size = ARGS_SIZE(GemvArgs) + batch * n;
+  if (rows > 0) {
+    const size_t n_dpus = nr_dpus(dpu_set);
+    const size_t stride = size + batch * rows;
+    for (size_t d = 0; d < n_dpus; d++) {
+      memcpy(blocks + d * stride + ARGS_SIZE(GemvArgs), in,
+             batch * n * sizeof(float));
+    }
+    push_blocks(dpu_set, DPU_XFER_TO_DPU, "in", blocks, stride);
+  } else {
+    memcpy(blocks + ARGS_SIZE(GemvArgs), in, batch * n * sizeof(float));
+    broadcast_to(dpu_set, "in", 0, blocks, size * sizeof(float));
+  }
 
-      for (size_t i = 0; i < DIM / (QKV_TASKLETS * 2); i++) {
-        data[i].dpu = i;
-        data[i].pos = pos;
-      }
+  launch(dpu_set);
 
-      load_dpu_kernel(dpus->qkv, qkv);
-      dpu_broadcast_to(dpus->qkv, "x", 0, xb, DIM * sizeof(float),
-                       DPU_XFER_DEFAULT);
+  push_blocks(dpu_set, DPU_XFER_FROM_DPU, "out", out, batch * out_rows);
+}
 
-      DPU_FOREACH(dpus->qkv, dpu, i) {
-        dpu_prepare_xfer(dpu, w->wq + (l * DIM * DIM) +
-                                  (i * QKV_TASKLETS * 2 * DIM));
-      }
-      dpu_push_xfer(dpus->qkv, DPU_XFER_TO_DPU, "wq", 0,
-                    QKV_TASKLETS * 2 * DIM * sizeof(float), DPU_XFER_DEFAULT);
+// a block of tokens on its way through the layers. token b is at position
+// pos[b] of the sequence whose kv cache is in slot slot[b], tokens of the
+// same sequence have to be in order. only the last n_logits tokens of the
+// block finish the last layer and get logits (n_logits x vocab_size), the
+// others are done once their k and v are in the cache. everything async
+// transfers read or write lives here, as other blocks are in flight at the
+// same time.
+struct Block {
+  int batch;
+  int n_logits;
+  uint32_t pos[MAX_BATCH];
+  uint32_t slot[MAX_BATCH];
+  // batch x n vectors
+  float *x, *xb, *hb, *q, *k, *v, *logits;
+  // launch blocks of every stage, the arguments followed by the inputs,
+  // shared by all dpus of a stage or one per dpu
+  float *qkv_in, *mha_in, *attnout_in, *ffn1_in, *ffn2_in, *cls_in;
+  // per-dpu blocks of the outputs
+  float *qkv_out, *mha_x, *attnout_x, *ffn1_hb, *ffn2_x, *cls_logits;
+};
 
-      DPU_FOREACH(dpus->qkv, dpu, i) {
-        dpu_prepare_xfer(dpu, w->wk + (l * DIM * KV_DIM) +
-                                  (i * QKV_TASKLETS * 2 * DIM));
-      }
-      dpu_push_xfer(dpus->qkv, DPU_XFER_TO_DPU, "wk", 0,
-                    QKV_TASKLETS * 2 * DIM * sizeof(float), DPU_XFER_DEFAULT);
+// one per layer group, so a block can be in every group of the pipeline
+static struct Block *blocks = nullptr;
+// block in each group of the pipeline, -1 for none
+static int *in_flight = nullptr;
+
+static void alloc_block(struct Block *block, const Config *p,
+                        const struct DpuSets *dpus, size_t max_batch) {
+  const size_t dim = p->dim;
+  const size_t kv_dim = dim * p->n_kv_heads / p->n_heads;
+  const size_t hidden_dim = p->hidden_dim;
+  block->x = malloc(max_batch * dim * sizeof(float));
+  block->xb = malloc(max_batch * dim * sizeof(float));
+  block->hb = malloc(max_batch * hidden_dim * sizeof(float));
+  block->q = malloc(max_batch * dim * sizeof(float));
+  block->k = malloc(max_batch * dim * sizeof(float));
+  block->v = malloc(max_batch * dim * sizeof(float));
+  block->logits = malloc(max_batch * p->vocab_size * sizeof(float));
+
+  // the stages adding to a residual have a copy of the input per dpu
+  const size_t gemv_args = ARGS_SIZE(GemvArgs);
+  const size_t n_attnout = nr_dpus(dpus->attnout);
+  const size_t n_ffn2 = nr_dpus(dpus->ffn2);
+  block->qkv_in = malloc((gemv_args + max_batch * dim) * sizeof(float));
+  block->mha_in = malloc((p->n_kv_heads * ARGS_SIZE(MhaArgs) +
+                          max_batch * (dim + 2 * kv_dim)) *
+                         sizeof(float));
+  block->attnout_in = malloc(
+      (n_attnout * (gemv_args + max_batch * dim) + max_batch * dim) *
+      sizeof(float));
+  block->ffn1_in = malloc((gemv_args + max_batch * dim) * sizeof(float));
+  block->ffn2_in = malloc(
+      (n_ffn2 * (gemv_args + max_batch * hidden_dim) + max_batch * dim) *
+      sizeof(float));
+  block->cls_in = malloc((gemv_args + max_batch * dim) * sizeof(float));
+
+  block->qkv_out = malloc(max_batch * (dim + 2 * kv_dim) * sizeof(float));
+  block->mha_x = malloc(max_batch * dim * sizeof(float));
+  block->attnout_x = malloc(max_batch * dim * sizeof(float));
+  block->ffn1_hb = malloc(max_batch * hidden_dim * sizeof(float));
+  block->ffn2_x = malloc(max_batch * dim * sizeof(float));
+  block->cls_logits = malloc(max_batch * p->vocab_size * sizeof(float));
+}
 
-      DPU_FOREACH(dpus->qkv, dpu, i) {
-        dpu_prepare_xfer(dpu, w->wv + (l * DIM * KV_DIM) +
-                                  (i * QKV_TASKLETS * 2 * DIM));
-      }
-      dpu_push_xfer(dpus->qkv, DPU_XFER_TO_DPU, "wv", 0,
-                    QKV_TASKLETS * 2 * DIM * sizeof(float), DPU_XFER_DEFAULT);
+static void free_block(struct Block *block) {
+  free(block->x);
+  free(block->xb);
+  free(block->hb);
+  free(block->q);
+  free(block->k);
+  free(block->v);
+  free(block->logits);
+  free(block->qkv_in);
+  free(block->mha_in);
+  free(block->attnout_in);
+  free(block->ffn1_in);
+  free(block->ffn2_in);
+  free(block->cls_in);
+  free(block->qkv_out);
+  free(block->mha_x);
+  free(block->attnout_x);
+  free(block->ffn1_hb);
+  free(block->ffn2_x);
+  free(block->cls_logits);
+}
 
-      DPU_FOREACH(dpus->qkv, dpu, i) { dpu_prepare_xfer(dpu, data + i); }
-      dpu_push_xfer(dpus->qkv, DPU_XFER_TO_DPU, "data", 0, sizeof(data[0]),
-                    DPU_XFER_DEFAULT);
+static void init_upmem(Transformer *transformer) {
+  const Config *p = &transformer->config;
+  const TransformerWeights *w = &transformer->weights;
+  const char *upmem_profile = getenv("UPMEM_PROFILE");
 
-      dpu_launch(dpus->qkv, DPU_SYNCHRONOUS);
+  // q8 checkpoints keep their group size, so the dpus see the same weights
+  if (transformer->group_size > 0) {
+    group_size = transformer->group_size;
+  } else if (transformer->upmem_q8) {
+    group_size = default_group_size(p);
+  }
 
-      DPU_FOREACH(dpus->qkv, dpu, i) {
-        dpu_prepare_xfer(dpu, q + (i * QKV_TASKLETS * 2));
-      }
-      dpu_push_xfer(dpus->qkv, DPU_XFER_FROM_DPU, "q", 0,
-                    QKV_TASKLETS * 2 * sizeof(float), DPU_XFER_DEFAULT);
+  check_config(p);
+  n_groups = nr_groups(transformer);
+  if (p->n_layers % n_groups != 0) {
+    fprintf(stderr, "upmem: %u layers don't split into %u groups\n",
+            p->n_layers, n_groups);
+    exit(EXIT_FAILURE);
+  }
 
-      DPU_FOREACH(dpus->qkv, dpu, i) {
-        dpu_prepare_xfer(dpu, k + (i * QKV_TASKLETS * 2));
-      }
-      dpu_push_xfer(dpus->qkv, DPU_XFER_FROM_DPU, "k", 0,
-                    QKV_TASKLETS * 2 * sizeof(float), DPU_XFER_DEFAULT);
+  // the dpu counts follow from the checkpoint's dimensions and the ranks
+  struct DpuSets plan;
+  uint32_t nr_ranks, rank_size;
+  available_ranks(transformer->upmem_ranks, &nr_ranks, &rank_size);
+  nr_ranks_used = plan_partition(&plan, p, n_groups, nr_ranks, rank_size);
+  if (nr_ranks_used == 0) {
+    fprintf(stderr, "upmem: model needs more than the %u ranks available\n",
+            nr_ranks);
+    exit(EXIT_FAILURE);
+  }
 
-      DPU_FOREACH(dpus->qkv, dpu, i) {
-        dpu_prepare_xfer(dpu, v + (i * QKV_TASKLETS * 2));
-      }
-      dpu_push_xfer(dpus->qkv, DPU_XFER_FROM_DPU, "v", 0,
-                    QKV_TASKLETS * 2 * sizeof(float), DPU_XFER_DEFAULT);
+  // the kernels of a group only see its layers
+  Config group_config = *p;
+  group_config.n_layers = p->n_layers / n_groups;
+
+  groups = calloc(n_groups, sizeof(*groups));
+  for (uint32_t g = 0; g < n_groups; g++) {
+    struct DpuSets *dpus = &groups[g];
+    *dpus = plan;
+    dpus->first_layer = g * group_config.n_layers;
+    dpus->n_layers = group_config.n_layers;
+    dpus->last = g == n_groups - 1;
+
+    if (dpus->last) {
+      DPU_ASSERT(dpu_alloc(p->vocab_size / dpus->cls_rows, upmem_profile,
+                           &dpus->cls));
+    }
+    DPU_ASSERT(dpu_alloc(p->hidden_dim / dpus->ffn1_rows, upmem_profile,
+                         &dpus->ffn1));
+    DPU_ASSERT(dpu_alloc(p->n_kv_heads, upmem_profile, &dpus->mha));
+    DPU_ASSERT(dpu_alloc(p->dim / dpus->qkv_rows, upmem_profile, &dpus->qkv));
+
+    // qkv, attnout and ffn2 each keep their weights in mram, so they can't
+    // share a dpu set (and its mram layout) anymore
+    DPU_ASSERT(dpu_alloc(p->dim / dpus->attnout_rows, upmem_profile,
+                         &dpus->attnout));
+    DPU_ASSERT(
+        dpu_alloc(p->dim / dpus->ffn2_rows, upmem_profile, &dpus->ffn2));
+
+    // programs are loaded exactly once, the layer loop only launches them
+    if (dpus->last) {
+      DPU_ASSERT(load_matvec_kernel(dpus->cls, cls));
+    }
+    DPU_ASSERT(load_matvec_kernel(dpus->ffn1, ffn1));
+    DPU_ASSERT(load_dpu_kernel(dpus->mha, mha));
+    DPU_ASSERT(load_matvec_kernel(dpus->qkv, qkv));
+    DPU_ASSERT(load_matvec_kernel(dpus->attnout, attout));
+    DPU_ASSERT(load_matvec_kernel(dpus->ffn2, ffn2));
+
+    if (dpus->last) {
+      write_config(dpus->cls, &group_config, dpus->cls_rows, p->dim);
+    }
+    write_config(dpus->ffn1, &group_config, dpus->ffn1_rows, p->dim);
+    write_config(dpus->mha, &group_config, 0, 0);
+    write_config(dpus->qkv, &group_config, dpus->qkv_rows, p->dim);
+    write_config(dpus->attnout, &group_config, dpus->attnout_rows, p->dim);
+    write_config(dpus->ffn2, &group_config, dpus->ffn2_rows, p->hidden_dim);
+
+    // weights don't change between tokens, so we only load them once
+    shard_weights(dpus, w, p);
+    broadcast_weights(dpus->qkv, "rope_table", transformer->state.rope,
+                      p->seq_len * (p->dim / p->n_heads));
+  }
+  stats.startup_loads = stats.program_loads;
+
+  blocks = calloc(n_groups, sizeof(*blocks));
+  in_flight = malloc(n_groups * sizeof(*in_flight));
+  for (uint32_t g = 0; g < n_groups; g++) {
+    alloc_block(&blocks[g], p, &groups[g], max_block(transformer));
+    in_flight[g] = -1;
+  }
+}
+
+void free_upmem(void) {
+  if (!groups) {
+    return;
+  }
+  for (uint32_t g = 0; g < n_groups; g++) {
+    struct DpuSets *dpus = &groups[g];
+    DPU_ASSERT(dpu_free(dpus->qkv));
+    DPU_ASSERT(dpu_free(dpus->mha));
+    if (dpus->last) {
+      DPU_ASSERT(dpu_free(dpus->cls));
     }
+    DPU_ASSERT(dpu_free(dpus->ffn1));
+    DPU_ASSERT(dpu_free(dpus->ffn2));
+    DPU_ASSERT(dpu_free(dpus->attnout));
+    free_block(&blocks[g]);
+  }
+  free(groups);
+  free(blocks);
+  free(in_flight);
+  groups = nullptr;
+  blocks = nullptr;
+  in_flight = nullptr;
+  // the kv cache went with the mha dpus, and the stats with the plan
+  stats = (typeof(stats)){};
+}
 
-    { // multihead attention
-      struct {
-        float scale;
-        uint32_t pos;
-      } data = {.scale = sqrtf(HEAD_SIZE), .pos = pos};
-
-      // transpose key & value cache on cpu for sequential access on the dpus
-      // q: layer x heads x head_size
-      // kc: layer x seq_len x heads x head_size
-      //   -> layer x heads x seq_len x head_size
-      // vc: layer x seq_len x heads x head_size
-      //   -> layer x heads x head_size x seq_len
-
-      for (size_t h = 0; h < N_HEADS; h++) {
-        for (size_t p = 0; p < SEQ_LEN; p++) {
-          for (size_t o = 0; o < HEAD_SIZE; o++) {
-            tkc[((h * SEQ_LEN) + p) * HEAD_SIZE + o] =
-                kc[loff + ((p * N_HEADS) + h) * HEAD_SIZE + o];
-            tvc[((h * HEAD_SIZE) + o) * SEQ_LEN + p] =
-                vc[loff + ((p * N_HEADS) + h) * HEAD_SIZE + o];
-          }
-        }
-      }
+void upmem_rank_range(const Transformer *transformer, int *required,
+                      int *available) {
+  struct DpuSets plan;
+  uint32_t nr_ranks, rank_size;
+  available_ranks(0, &nr_ranks, &rank_size);
+  *available = nr_ranks;
+  *required = 0;
+  for (uint32_t r = 1; r <= nr_ranks && *required == 0; r++) {
+    if (plan_partition(&plan, &transformer->config, nr_groups(transformer), r,
+                       rank_size) > 0) {
+      *required = r;
+    }
+  }
+}
 
-      dpu_broadcast_to(dpus->mha, "data", 0, &data, sizeof(data),
-                       DPU_XFER_DEFAULT);
+int upmem_nr_dpus(void) {
+  int n = 0;
+  for (uint32_t g = 0; groups && g < n_groups; g++) {
+    const struct DpuSets *dpus = &groups[g];
+    n += nr_dpus(dpus->qkv) + nr_dpus(dpus->mha) + nr_dpus(dpus->ffn1) +
+         nr_dpus(dpus->ffn2) + nr_dpus(dpus->attnout);
+    if (dpus->last) {
+      n += nr_dpus(dpus->cls);
+    }
+  }
+  return n;
+}
 
-      DPU_FOREACH(dpus->mha, dpu, i) {
-        dpu_prepare_xfer(dpu, q + i * HEAD_SIZE);
-      }
-      dpu_push_xfer(dpus->mha, DPU_XFER_TO_DPU, "q", 0,
-                    HEAD_SIZE * sizeof(float), DPU_XFER_DEFAULT);
+// tokens of the block finishing layer l, from the first one on
+static int finishing(const Config *p, const struct Block *block, size_t l) {
+  return l == p->n_layers - 1 ? block->n_logits : block->batch;
+}
 
-      DPU_FOREACH(dpus->mha, dpu, i) {
-        dpu_prepare_xfer(dpu, tkc + i * SEQ_LEN * HEAD_SIZE);
-      }
-      dpu_push_xfer(dpus->mha, DPU_XFER_TO_DPU, "kc", 0,
-                    HEAD_SIZE * SEQ_LEN * sizeof(float), DPU_XFER_DEFAULT);
+// every stage of a layer is a prepare, which packs the parts of its launch
+// block that don't depend on the stage before while that one runs, a
+// launch, which queues the stage's inputs, the launch itself and its
+// outputs, and a finish, which waits for the outputs. l is the layer of the
+// model.
+typedef void (*Phase)(const Config *p, struct DpuSets *dpus,
+                      struct Block *block, size_t l);
+
+// attention rmsnorm, qkv matmuls & RoPE
+static void qkv_prepare(const Config *p, struct DpuSets *dpus,
+                        struct Block *block, size_t l) {
+  GemvArgs args = {.layer = l - dpus->first_layer, .batch = block->batch};
+  memcpy(args.pos, block->pos, sizeof(block->pos));
+  gemv_prepare(dpus->qkv, block->qkv_in, &args, p->dim, nullptr, 0);
+}
 
-      DPU_FOREACH(dpus->mha, dpu, i) {
-        dpu_prepare_xfer(dpu, tvc + i * HEAD_SIZE * SEQ_LEN);
-      }
-      dpu_push_xfer(dpus->mha, DPU_XFER_TO_DPU, "vc", 0,
-                    HEAD_SIZE * SEQ_LEN * sizeof(float), DPU_XFER_DEFAULT);
+static void qkv_launch(const Config *p, struct DpuSets *dpus,
+                       struct Block *block, size_t) {
+  // every dpu returns its rows of q, then those of k and v
+  gemv_launch(dpus->qkv, block->qkv_in, block->batch, block->x, p->dim, 0,
+              block->qkv_out, dpus->qkv_rows + 2 * kv_rows(p, dpus));
+}
 
-      dpu_launch(dpus->mha, DPU_SYNCHRONOUS);
+static void qkv_finish(const Config *p, struct DpuSets *dpus,
+                       struct Block *block, size_t) {
+  sync_dpus(dpus->qkv);
+
+  const size_t kv_dim = p->dim * p->n_kv_heads / p->n_heads;
+  const size_t batch = block->batch;
+  const size_t rows = dpus->qkv_rows;
+  const size_t kv = kv_rows(p, dpus);
+  const size_t stride = batch * (rows + 2 * kv);
+  unpack(block->q, block->qkv_out, stride, p->dim, rows, batch);
+  unpack(block->k, block->qkv_out + batch * rows, stride, kv_dim, kv, batch);
+  unpack(block->v, block->qkv_out + batch * (rows + kv), stride, kv_dim, kv,
+         batch);
+}
 
-      DPU_FOREACH(dpus->mha, dpu, i) {
-        dpu_prepare_xfer(dpu, xb + i * HEAD_SIZE);
-      }
-      dpu_push_xfer(dpus->mha, DPU_XFER_FROM_DPU, "x", 0,
-                    HEAD_SIZE * sizeof(float), DPU_XFER_DEFAULT);
+// the kv cache stays in the mram of the mha dpus, one kv head per dpu and one
+// slot per sequence, a row per position which the kernel streams once for
+// all query heads sharing the kv head. tokens of the same sequence are
+// attended in order, so later ones see the k and v of earlier ones in the
+// block:
+// kc, vc: slot x layer x seq_len x head_size
+// each token only inserts the k and v of its own position. the launch block
+// of a dpu holds the arguments, then the query heads of its kv head, which
+// are consecutive, then k and v.
+static size_t mha_stride(const Config *p, const struct Block *block) {
+  const size_t head_size = p->dim / p->n_heads;
+  const size_t q_size = p->dim / p->n_kv_heads;
+  return ARGS_SIZE(MhaArgs) + block->batch * (q_size + 2 * head_size);
+}
 
-      DPU_FOREACH(dpus->mha, dpu, i) {
-        dpu_prepare_xfer(dpu, att + i * SEQ_LEN);
-      }
-      dpu_push_xfer(dpus->mha, DPU_XFER_FROM_DPU, "att", 0,
-                    SEQ_LEN * sizeof(float), DPU_XFER_DEFAULT);
-    }
+static void mha_prepare(const Config *p, struct DpuSets *dpus,
+                        struct Block *block, size_t l) {
+  MhaArgs args = {
+      .scale = sqrtf(p->dim / p->n_heads),
+      .layer = l - dpus->first_layer,
+      .batch = block->batch,
+      .kv_only = finishing(p, block, l) == 0,
+  };
+  memcpy(args.pos, block->pos, sizeof(block->pos));
+  memcpy(args.slot, block->slot, sizeof(block->slot));
+  const size_t stride = mha_stride(p, block);
+  for (size_t d = 0; d < p->n_kv_heads; d++) {
+    memcpy(block->mha_in + d * stride, &args, sizeof(args));
+  }
+}
 
-    { // attention output
-      load_dpu_kernel(dpus->attnout, attout);
+static void mha_launch(const Config *p, struct DpuSets *dpus,
+                       struct Block *block, size_t l) {
+  const size_t dim = p->dim;
+  const size_t head_size = dim / p->n_heads;
+  const size_t kv_dim = head_size * p->n_kv_heads;
+  const size_t batch = block->batch;
+  const size_t q_size = dim / p->n_kv_heads;
+  const size_t stride = mha_stride(p, block);
+  float *q = block->mha_in + ARGS_SIZE(MhaArgs);
+  pack(q, stride, block->q, dim, q_size, batch);
+  pack(q + batch * q_size, stride, block->k, kv_dim, head_size, batch);
+  pack(q + batch * (q_size + head_size), stride, block->v, kv_dim, head_size,
+       batch);
+  push_blocks(dpus->mha, DPU_XFER_TO_DPU, "in", block->mha_in, stride);
+
+  launch(dpus->mha);
+
+  if (finishing(p, block, l) > 0) {
+    push_blocks(dpus->mha, DPU_XFER_FROM_DPU, "x", block->mha_x,
+                batch * q_size);
+  }
+}
 
-      DPU_FOREACH(dpus->attnout, dpu, i) { dpu_prepare_xfer(dpu, x + i * 16); }
-      dpu_push_xfer(dpus->attnout, DPU_XFER_TO_DPU, "x", 0, 16 * sizeof(float),
-                    DPU_XFER_DEFAULT);
-      dpu_broadcast_to(dpus->attnout, "xb", 0, xb, DIM * sizeof(float),
-                       DPU_XFER_DEFAULT);
+static void mha_finish(const Config *p, struct DpuSets *dpus,
+                       struct Block *block, size_t l) {
+  sync_dpus(dpus->mha);
 
-      DPU_FOREACH(dpus->attnout, dpu, i) {
-        dpu_prepare_xfer(dpu, w->wo + l * DIM * DIM + i * 16 * DIM);
-      }
-      dpu_push_xfer(dpus->attnout, DPU_XFER_TO_DPU, "wo", 0,
-                    16 * DIM * sizeof(float), DPU_XFER_DEFAULT);
+  if (finishing(p, block, l) > 0) {
+    const size_t q_size = p->dim / p->n_kv_heads;
+    unpack(block->xb, block->mha_x, block->batch * q_size, p->dim, q_size,
+           block->batch);
+  }
+}
 
-      dpu_launch(dpus->attnout, DPU_SYNCHRONOUS);
+// from here on x holds the tokens finishing the layer, which is all of them
+// but in the last layer
+static void attnout_prepare(const Config *p, struct DpuSets *dpus,
+                            struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  const int first = block->batch - rest;
+  const GemvArgs args = {.layer = l - dpus->first_layer, .batch = rest};
+  // x is the residual
+  gemv_prepare(dpus->attnout, block->attnout_in, &args, p->dim,
+               block->x + first * p->dim, dpus->attnout_rows);
+}
 
-      DPU_FOREACH(dpus->attnout, dpu, i) { dpu_prepare_xfer(dpu, x + i * 16); }
-      dpu_push_xfer(dpus->attnout, DPU_XFER_FROM_DPU, "x", 0,
-                    16 * sizeof(float), DPU_XFER_DEFAULT);
-    }
+static void attnout_launch(const Config *p, struct DpuSets *dpus,
+                           struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  const int first = block->batch - rest;
+  gemv_launch(dpus->attnout, block->attnout_in, rest,
+              block->xb + first * p->dim, p->dim, dpus->attnout_rows,
+              block->attnout_x, dpus->attnout_rows);
+}
 
-    { // ffn rmsnorm
-      dpu_broadcast_to(dpus->rmsnorm, "w", 0, w->rms_ffn_weight + l * DIM,
-                       DIM * sizeof(float), DPU_XFER_DEFAULT);
-      dpu_broadcast_to(dpus->rmsnorm, "x", 0, x, DIM * sizeof(float),
-                       DPU_XFER_DEFAULT);
-      dpu_broadcast_to(dpus->rmsnorm, "data", 0, &zero, 2 * sizeof(float),
-                       DPU_XFER_DEFAULT);
+static void attnout_finish(const Config *p, struct DpuSets *dpus,
+                           struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  sync_dpus(dpus->attnout);
 
-      dpu_launch(dpus->rmsnorm, DPU_SYNCHRONOUS);
+  const size_t rows = dpus->attnout_rows;
+  unpack(block->x, block->attnout_x, rest * rows, p->dim, rows, rest);
+}
 
-      DPU_FOREACH(dpus->rmsnorm, dpu, i) { dpu_prepare_xfer(dpu, xb); }
-      dpu_push_xfer(dpus->rmsnorm, DPU_XFER_FROM_DPU, "x", 0,
-                    DIM * sizeof(float), DPU_XFER_DEFAULT);
-    }
+// ffn rmsnorm & ffn
+static void ffn1_prepare(const Config *p, struct DpuSets *dpus,
+                         struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  const GemvArgs args = {.layer = l - dpus->first_layer, .batch = rest};
+  gemv_prepare(dpus->ffn1, block->ffn1_in, &args, p->dim, nullptr, 0);
+}
 
-    { // ffn
-      DPU_FOREACH(dpus->ffn1, dpu, i) {
-        dpu_prepare_xfer(dpu, w->w1 + l * DIM * HIDDEN_DIM + i * 4 * 16 * DIM);
-      }
-      dpu_push_xfer(dpus->ffn1, DPU_XFER_TO_DPU, "w1", 0,
-                    4 * 16 * DIM * sizeof(float), DPU_XFER_DEFAULT);
+static void ffn1_launch(const Config *p, struct DpuSets *dpus,
+                        struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  gemv_launch(dpus->ffn1, block->ffn1_in, rest, block->x, p->dim, 0,
+              block->ffn1_hb, dpus->ffn1_rows);
+}
 
-      DPU_FOREACH(dpus->ffn1, dpu, i) {
-        dpu_prepare_xfer(dpu, w->w3 + l * DIM * HIDDEN_DIM + i * 4 * 16 * DIM);
-      }
-      dpu_push_xfer(dpus->ffn1, DPU_XFER_TO_DPU, "w3", 0,
-                    4 * 16 * DIM * sizeof(float), DPU_XFER_DEFAULT);
+static void ffn1_finish(const Config *p, struct DpuSets *dpus,
+                        struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  sync_dpus(dpus->ffn1);
+
+  const size_t rows = dpus->ffn1_rows;
+  unpack(block->hb, block->ffn1_hb, rest * rows, p->hidden_dim, rows, rest);
+}
 
-      dpu_broadcast_to(dpus->ffn1, "xb", 0, xb, DIM * sizeof(float),
-                       DPU_XFER_DEFAULT);
+static void ffn2_prepare(const Config *p, struct DpuSets *dpus,
+                         struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  const GemvArgs args = {.layer = l - dpus->first_layer, .batch = rest};
+  // x is the residual
+  gemv_prepare(dpus->ffn2, block->ffn2_in, &args, p->hidden_dim, block->x,
+               dpus->ffn2_rows);
+}
 
-      dpu_launch(dpus->ffn1, DPU_SYNCHRONOUS);
+static void ffn2_launch(const Config *p, struct DpuSets *dpus,
+                        struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  gemv_launch(dpus->ffn2, block->ffn2_in, rest, block->hb, p->hidden_dim,
+              dpus->ffn2_rows, block->ffn2_x, dpus->ffn2_rows);
+}
 
-      DPU_FOREACH(dpus->ffn1, dpu, i) {
-        dpu_prepare_xfer(dpu, hb + i * 4 * 16);
-      }
-      dpu_push_xfer(dpus->ffn1, DPU_XFER_FROM_DPU, "hb", 0,
-                    4 * 16 * sizeof(float), DPU_XFER_DEFAULT);
+static void ffn2_finish(const Config *p, struct DpuSets *dpus,
+                        struct Block *block, size_t l) {
+  const int rest = finishing(p, block, l);
+  if (rest == 0) {
+    return;
+  }
+  sync_dpus(dpus->ffn2);
 
-      load_dpu_kernel(dpus->ffn2, ffn2);
+  const size_t rows = dpus->ffn2_rows;
+  unpack(block->x, block->ffn2_x, rest * rows, p->dim, rows, rest);
+}
 
-      dpu_broadcast_to(dpus->ffn2, "hb", 0, hb, HIDDEN_DIM * sizeof(float),
-                       DPU_XFER_DEFAULT);
+// final rmsnorm & classifier into logits
+static void cls_prepare(const Config *p, struct DpuSets *dpus,
+                        struct Block *block, size_t) {
+  if (!dpus->last || block->n_logits == 0) {
+    return;
+  }
+  const GemvArgs args = {.layer = 0, .batch = block->n_logits};
+  gemv_prepare(dpus->cls, block->cls_in, &args, p->dim, nullptr, 0);
+}
 
-      DPU_FOREACH(dpus->ffn2, dpu, i) {
-        dpu_prepare_xfer(dpu,
-                         w->w2 + l * DIM * HIDDEN_DIM + i * 16 * HIDDEN_DIM);
-      }
-      dpu_push_xfer(dpus->ffn2, DPU_XFER_TO_DPU, "w2", 0,
-                    16 * HIDDEN_DIM * sizeof(float), DPU_XFER_DEFAULT);
+static void cls_launch(const Config *p, struct DpuSets *dpus,
+                       struct Block *block, size_t) {
+  if (!dpus->last || block->n_logits == 0) {
+    return;
+  }
+  gemv_launch(dpus->cls, block->cls_in, block->n_logits, block->x, p->dim, 0,
+              block->cls_logits, dpus->cls_rows);
+}
 
-      DPU_FOREACH(dpus->ffn2, dpu, i) { dpu_prepare_xfer(dpu, x + i * 16); }
-      dpu_push_xfer(dpus->ffn2, DPU_XFER_TO_DPU, "x", 0, 16 * sizeof(float),
-                    DPU_XFER_DEFAULT);
+static void cls_finish(const Config *p, struct DpuSets *dpus,
+                       struct Block *block, size_t) {
+  if (!dpus->last || block->n_logits == 0) {
+    return;
+  }
+  sync_dpus(dpus->cls);
 
-      dpu_launch(dpus->ffn2, DPU_SYNCHRONOUS);
+  const size_t rows = dpus->cls_rows;
+  unpack(block->logits, block->cls_logits, block->n_logits * rows,
+         p->vocab_size, rows, block->n_logits);
+}
 
-      DPU_FOREACH(dpus->ffn2, dpu, i) { dpu_prepare_xfer(dpu, x + i * 16); }
-      dpu_push_xfer(dpus->ffn2, DPU_XFER_FROM_DPU, "x", 0, 16 * sizeof(float),
-                    DPU_XFER_DEFAULT);
+// moves block[i] through the layers of group[i]. the groups advance in
+// lockstep: a stage is launched in every group before the host waits for
+// any of them, so in async mode their dpu sets run at the same time. the
+// host prepares the next stage, or the qkv of the next layer or the
+// classifier after the last one, before it waits.
+static void run_groups(const Config *p, struct DpuSets **group,
+                       struct Block **block, int n) {
+  static const Phase prepares[] = {qkv_prepare, mha_prepare, attnout_prepare,
+                                   ffn1_prepare, ffn2_prepare};
+  static const Phase launches[] = {qkv_launch, mha_launch, attnout_launch,
+                                   ffn1_launch, ffn2_launch};
+  static const Phase finishes[] = {qkv_finish, mha_finish, attnout_finish,
+                                   ffn1_finish, ffn2_finish};
+  const size_t n_stages = sizeof(launches) / sizeof(launches[0]);
+
+  for (int i = 0; i < n; i++) {
+    qkv_prepare(p, group[i], block[i], group[i]->first_layer);
+  }
+  // all groups have the same number of layers
+  const size_t n_layers = group[0]->n_layers;
+  for (size_t l = 0; l < n_layers; l++) {
+    for (size_t s = 0; s < n_stages; s++) {
+      for (int i = 0; i < n; i++) {
+        launches[s](p, group[i], block[i], group[i]->first_layer + l);
+      }
+      for (int i = 0; i < n; i++) {
+        const size_t layer = group[i]->first_layer + l;
+        if (s + 1 < n_stages) {
+          prepares[s + 1](p, group[i], block[i], layer);
+        } else if (l + 1 < n_layers) {
+          qkv_prepare(p, group[i], block[i], layer + 1);
+        } else {
+          cls_prepare(p, group[i], block[i], p->n_layers);
+        }
+      }
+      for (int i = 0; i < n; i++) {
+        finishes[s](p, group[i], block[i], group[i]->first_layer + l);
+      }
     }
   }
+  for (int i = 0; i < n; i++) {
+    cls_launch(p, group[i], block[i], p->n_layers);
+  }
+  for (int i = 0; i < n; i++) {
+    cls_finish(p, group[i], block[i], p->n_layers);
+  }
+}
+
+// copies the token embeddings into x of a block entering the first layer
+static void start_block(struct Block *block, const Transformer *transformer,
+                        const int *tokens, const int *pos, const int *slots,
+                        int batch, int n_logits) {
+  const int dim = transformer->config.dim;
+  block->batch = batch;
+  block->n_logits = n_logits;
+  for (int b = 0; b < batch; b++) {
+    block->pos[b] = pos[b];
+    block->slot[b] = slots[b];
+    memcpy(block->x + b * dim,
+           transformer->weights.token_embedding_table + tokens[b] * dim,
+           dim * sizeof(float));
+  }
+}
+
+// advances a block of tokens through all layers, one group after the other
+static float *forward_block(Transformer *transformer, const int *tokens,
+                            const int *pos, const int *slots, int batch,
+                            int n_logits) {
+  Config *p = &transformer->config;
+  RunState *s = &transformer->state;
+
+  if (!groups) {
+    init_upmem(transformer);
+  }
+
+  const double start = now_ms();
+  async = transformer->upmem_async;
+
+  struct Block *block = &blocks[0];
+  start_block(block, transformer, tokens, pos, slots, batch, n_logits);
+  memcpy(s->x, block->x, p->dim * sizeof(float));
+
+  for (uint32_t g = 0; g < n_groups; g++) {
+    struct DpuSets *group = &groups[g];
+    run_groups(p, &group, &block, 1);
+  }
+
+  stats.tokens += batch;
+  stats.wall_ms += now_ms() - start;
+  return block->logits;
+}
 
-  { // final rmsnorm
-    dpu_broadcast_to(dpus->rmsnorm, "w", 0, w->rms_final_weight,
-                     DIM * sizeof(float), DPU_XFER_DEFAULT);
-    dpu_broadcast_to(dpus->rmsnorm, "x", 0, x, DIM * sizeof(float),
-                     DPU_XFER_DEFAULT);
-    dpu_broadcast_to(dpus->rmsnorm, "data", 0, &zero, 2 * sizeof(float),
-                     DPU_XFER_DEFAULT);
+float *forward_upmem(Transformer *transformer, int token, int pos) {
+  const int slot = 0;
+  return forward_block(transformer, &token, &pos, &slot, 1, 1);
+}
 
-    dpu_launch(dpus->rmsnorm, DPU_SYNCHRONOUS);
+void forward_kv_upmem(Transformer *transformer, int token, int pos) {
+  const int slot = 0;
+  forward_block(transformer, &token, &pos, &slot, 1, 0);
+}
 
-    DPU_FOREACH(dpus->rmsnorm, dpu, i) { dpu_prepare_xfer(dpu, x); }
-    dpu_push_xfer(dpus->rmsnorm, DPU_XFER_FROM_DPU, "x", 0, DIM * sizeof(float),
-                  DPU_XFER_DEFAULT);
+float *forward_upmem_batch(Transformer *transformer, const int *tokens,
+                           const int *pos, int batch) {
+  if (batch < 1 || batch > upmem_max_batch(transformer)) {
+    fprintf(stderr, "upmem: batch of %d sequences, at most %d supported\n",
+            batch, upmem_max_batch(transformer));
+    exit(EXIT_FAILURE);
   }
 
-  { // classifier into logits
-    // 20 dpus, 16 tasklets -> 320 threads -> 100 rows per thread
-    dpu_broadcast_to(dpus->cls, "x", 0, x, DIM * sizeof(float),
-                     DPU_XFER_DEFAULT);
+  int slots[MAX_BATCH];
+  for (int b = 0; b < batch; b++) {
+    slots[b] = b;
+  }
+  return forward_block(transformer, tokens, pos, slots, batch, batch);
+}
 
-    dpu_launch(dpus->cls, DPU_SYNCHRONOUS);
+float *forward_upmem_pipelined(Transformer *transformer, int block,
+                               const int *tokens, const int *pos, int batch) {
+  if (!groups) {
+    init_upmem(transformer);
+  }
+  if (block < 0 || block >= (int)n_groups || batch < 1 ||
+      batch > upmem_pipeline_batch(transformer)) {
+    fprintf(stderr,
+            "upmem: block %d of %d sequences, at most %u blocks of %d "
+            "supported\n",
+            block, batch, n_groups, upmem_pipeline_batch(transformer));
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t g = 0; g + 1 < n_groups; g++) {
+    if (in_flight[g] == block) {
+      fprintf(stderr, "upmem: block %d is still in the pipeline\n", block);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const double start = now_ms();
+  // the groups only run at the same time with queued launches
+  async = true;
+
+  int slots[MAX_BATCH];
+  for (int b = 0; b < batch; b++) {
+    slots[b] = block * upmem_pipeline_batch(transformer) + b;
+  }
+  start_block(&blocks[block], transformer, tokens, pos, slots, batch, batch);
 
-    DPU_FOREACH(dpus->cls, dpu, i) {
-      dpu_prepare_xfer(dpu, logits + i * 16 * CLS_ROWS_PER_THREAD);
+  // every block moves on to the next group
+  for (uint32_t g = n_groups - 1; g > 0; g--) {
+    in_flight[g] = in_flight[g - 1];
+  }
+  in_flight[0] = block;
+
+  struct DpuSets *group[MAX_N_LAYERS];
+  struct Block *moving[MAX_N_LAYERS];
+  int n = 0;
+  for (uint32_t g = 0; g < n_groups; g++) {
+    if (in_flight[g] >= 0) {
+      group[n] = &groups[g];
+      moving[n] = &blocks[in_flight[g]];
+      n++;
     }
-    dpu_push_xfer(dpus->cls, DPU_XFER_FROM_DPU, "logits", 0,
-                  16 * CLS_ROWS_PER_THREAD * sizeof(float), DPU_XFER_DEFAULT);
   }
+  run_groups(&transformer->config, group, moving, n);
+
+  stats.wall_ms += now_ms() - start;
+  const int done = in_flight[n_groups - 1];
+  if (done < 0) {
+    return nullptr;
+  }
+  stats.tokens += blocks[done].batch;
+  return blocks[done].logits;
+}
 
+// the prompt runs through the matvec kernels in blocks of up to max_block()
+// tokens, which all go to the kv cache slot of forward_upmem()
+float *forward_prefill_upmem(Transformer *transformer, const int *tokens,
+                             int n_tokens, int pos) {
+  const int block = max_block(transformer);
+  const int slots[MAX_BATCH] = {0};
+  int block_pos[MAX_BATCH];
+
+  float *logits = nullptr;
+  for (int i = 0; i < n_tokens; i += block) {
+    const int n = n_tokens - i < block ? n_tokens - i : block;
+    for (int b = 0; b < n; b++) {
+      block_pos[b] = pos + i + b;
+    }
+    // only the last token of the prompt needs logits
+    const int n_logits = i + n == n_tokens ? 1 : 0;
+    logits =
+        forward_block(transformer, tokens + i, block_pos, slots, n, n_logits);
+  }
   return logits;
 }
 
-void mha_big_test(int pos) {
-  static float *q = nullptr;
-  static float *kc = nullptr;
-  static float *vc = nullptr;
-  static float *xb = nullptr;
+// long-context attention: every head's positions are split into shards of up
+// to shard_len positions on dpus of their own. each dpu returns its values
+// weighted by the unnormalized softmax of its shard, with the max score and
+// the sum of exponentials, and the host merges the shards of a head.
+static const size_t mha_big_heads = 8;
+static const size_t mha_big_head_size = 4096;
+static const size_t mha_big_shard_len = 256;
+
+static struct {
+  struct dpu_set_t dpu_set;
+  size_t seq_len;
+  size_t shards; // per head
+  float *q;      // n_heads x head_size
+  // the cache as the dpus hold it, dpu d = h * shards + s has head h from
+  // position s * shard_len on. the last shard of a head is padded with zeros.
+  float *kc; // n_dpus x shard_len x head_size
+  float *vc; // n_dpus x head_size x shard_len
+  float *x;      // n_heads x head_size, merged output
+  float *shard_x;
+  struct {
+    float max;
+    float sum;
+  } *partial;
+} mha_big;
+
+static void free_mha_big(void) {
+  if (mha_big.seq_len == 0) {
+    return;
+  }
+  DPU_ASSERT(dpu_free(mha_big.dpu_set));
+  free(mha_big.q);
+  free(mha_big.kc);
+  free(mha_big.vc);
+  free(mha_big.x);
+  free(mha_big.shard_x);
+  free(mha_big.partial);
+  mha_big.seq_len = 0;
+}
 
-  static struct dpu_set_t dpu_set;
-  static bool first_run = true;
+static float random_float(void) { return (float)rand() / RAND_MAX - 0.5f; }
 
-  static const size_t n_heads = 8;
-  static const size_t head_size = 4096;
-  static const size_t seq_len = 256;
+int mha_big_setup(int seq_len) {
+  const size_t head_size = mha_big_head_size;
+  const size_t shard_len = mha_big_shard_len;
+  free_mha_big();
 
-  if (first_run) {
-    first_run = false;
+  mha_big.seq_len = seq_len;
+  mha_big.shards = (seq_len + shard_len - 1) / shard_len;
+  const size_t n_dpus = mha_big_heads * mha_big.shards;
 
-    q = malloc(n_heads * head_size * sizeof(float));
-    kc = malloc(n_heads * head_size * seq_len * sizeof(float));
-    vc = malloc(n_heads * head_size * seq_len * sizeof(float));
-    xb = malloc(n_heads * head_size * sizeof(float));
+  mha_big.q = malloc(mha_big_heads * head_size * sizeof(float));
+  mha_big.kc = calloc(n_dpus * shard_len * head_size, sizeof(float));
+  mha_big.vc = calloc(n_dpus * head_size * shard_len, sizeof(float));
+  mha_big.x = malloc(mha_big_heads * head_size * sizeof(float));
+  mha_big.shard_x = malloc(n_dpus * head_size * sizeof(float));
+  mha_big.partial = malloc(n_dpus * sizeof(*mha_big.partial));
 
-    dpu_alloc(n_heads, getenv("UPMEM_PROFILE"), &dpu_set);
-    dpu_load(dpu_set, "build/mha_big.kernel", nullptr);
+  for (size_t i = 0; i < mha_big_heads * head_size; i++) {
+    mha_big.q[i] = random_float();
+  }
+  for (size_t d = 0; d < n_dpus; d++) {
+    const size_t first = d % mha_big.shards * shard_len;
+    const size_t len = seq_len - first < shard_len ? seq_len - first
+                                                   : shard_len;
+    for (size_t i = 0; i < len * head_size; i++) {
+      mha_big.kc[d * shard_len * head_size + i] = random_float();
+    }
+    for (size_t i = 0; i < head_size; i++) {
+      for (size_t t = 0; t < len; t++) {
+        mha_big.vc[(d * head_size + i) * shard_len + t] = random_float();
+      }
+    }
   }
 
+  DPU_ASSERT(dpu_alloc(n_dpus, getenv("UPMEM_PROFILE"), &mha_big.dpu_set));
+  DPU_ASSERT(dpu_load(mha_big.dpu_set, "build/mha_big.kernel", nullptr));
+
+  // the cache stays in mram across calls
   size_t i = 0;
   struct dpu_set_t dpu;
+  DPU_FOREACH(mha_big.dpu_set, dpu, i) {
+    dpu_prepare_xfer(dpu, mha_big.kc + i * shard_len * head_size);
+  }
+  DPU_ASSERT(dpu_push_xfer(mha_big.dpu_set, DPU_XFER_TO_DPU, "kc", 0,
+                           shard_len * head_size * sizeof(float),
+                           DPU_XFER_DEFAULT));
+  DPU_FOREACH(mha_big.dpu_set, dpu, i) {
+    dpu_prepare_xfer(dpu, mha_big.vc + i * head_size * shard_len);
+  }
+  DPU_ASSERT(dpu_push_xfer(mha_big.dpu_set, DPU_XFER_TO_DPU, "vc", 0,
+                           head_size * shard_len * sizeof(float),
+                           DPU_XFER_DEFAULT));
 
+  // positions in every shard, only the last one of a head can be short
   struct {
     float scale;
-    uint32_t pos;
-  } data = {.scale = sqrtf(head_size), .pos = pos};
+    uint32_t len;
+  } *data = malloc(n_dpus * sizeof(*data));
+  for (size_t d = 0; d < n_dpus; d++) {
+    const size_t first = d % mha_big.shards * shard_len;
+    data[d].scale = sqrtf(head_size);
+    data[d].len = seq_len - first < shard_len ? seq_len - first : shard_len;
+  }
+  DPU_FOREACH(mha_big.dpu_set, dpu, i) { dpu_prepare_xfer(dpu, data + i); }
+  DPU_ASSERT(dpu_push_xfer(mha_big.dpu_set, DPU_XFER_TO_DPU, "data", 0,
+                           sizeof(data[0]), DPU_XFER_DEFAULT));
 
-  dpu_broadcast_to(dpu_set, "data", 0, &data, sizeof(data), DPU_XFER_DEFAULT);
+  free(data);
+  return n_dpus;
+}
 
-  DPU_FOREACH(dpu_set, dpu, i) { dpu_prepare_xfer(dpu, q + i * head_size); }
-  dpu_push_xfer(dpu_set, DPU_XFER_TO_DPU, "q", 0, head_size * sizeof(float),
-                DPU_XFER_DEFAULT);
+void mha_big_test(void) {
+  const size_t head_size = mha_big_head_size;
+  const size_t shards = mha_big.shards;
+  size_t i = 0;
+  struct dpu_set_t dpu;
 
-  DPU_FOREACH(dpu_set, dpu, i) {
-    dpu_prepare_xfer(dpu, kc + i * seq_len * head_size);
+  // every shard of a head gets its query
+  DPU_FOREACH(mha_big.dpu_set, dpu, i) {
+    dpu_prepare_xfer(dpu, mha_big.q + i / shards * head_size);
   }
-  dpu_push_xfer(dpu_set, DPU_XFER_TO_DPU, "kc", 0,
-                head_size * seq_len * sizeof(float), DPU_XFER_DEFAULT);
+  DPU_ASSERT(dpu_push_xfer(mha_big.dpu_set, DPU_XFER_TO_DPU, "q", 0,
+                           head_size * sizeof(float), DPU_XFER_DEFAULT));
 
-  DPU_FOREACH(dpu_set, dpu, i) {
-    dpu_prepare_xfer(dpu, vc + i * head_size * seq_len);
+  DPU_ASSERT(dpu_launch(mha_big.dpu_set, DPU_SYNCHRONOUS));
+
+  DPU_FOREACH(mha_big.dpu_set, dpu, i) {
+    dpu_prepare_xfer(dpu, mha_big.shard_x + i * head_size);
+  }
+  DPU_ASSERT(dpu_push_xfer(mha_big.dpu_set, DPU_XFER_FROM_DPU, "x", 0,
+                           head_size * sizeof(float), DPU_XFER_DEFAULT));
+  DPU_FOREACH(mha_big.dpu_set, dpu, i) {
+    dpu_prepare_xfer(dpu, mha_big.partial + i);
   }
-  dpu_push_xfer(dpu_set, DPU_XFER_TO_DPU, "vc", 0,
-                head_size * seq_len * sizeof(float), DPU_XFER_DEFAULT);
+  DPU_ASSERT(dpu_push_xfer(mha_big.dpu_set, DPU_XFER_FROM_DPU, "partial", 0,
+                           sizeof(mha_big.partial[0]), DPU_XFER_DEFAULT));
+
+  // log-sum-exp merge of the shards of every head
+  for (size_t h = 0; h < mha_big_heads; h++) {
+    float max = -INFINITY;
+    for (size_t s = 0; s < shards; s++) {
+      max = fmaxf(max, mha_big.partial[h * shards + s].max);
+    }
+    float *x = mha_big.x + h * head_size;
+    float sum = 0.0f;
+    memset(x, 0, head_size * sizeof(float));
+    for (size_t s = 0; s < shards; s++) {
+      const size_t d = h * shards + s;
+      const float weight = expf(mha_big.partial[d].max - max);
+      sum += weight * mha_big.partial[d].sum;
+      for (size_t j = 0; j < head_size; j++) {
+        x[j] += weight * mha_big.shard_x[d * head_size + j];
+      }
+    }
+    for (size_t j = 0; j < head_size; j++) {
+      x[j] /= sum;
+    }
+  }
+}
 
-  dpu_launch(dpu_set, DPU_SYNCHRONOUS);
+float mha_big_error(void) {
+  const size_t head_size = mha_big_head_size;
+  const size_t shard_len = mha_big_shard_len;
+  const size_t seq_len = mha_big.seq_len;
+  float *att = malloc(seq_len * sizeof(float));
+  float error = 0.0f;
+  for (size_t h = 0; h < mha_big_heads; h++) {
+    const float *q = mha_big.q + h * head_size;
+    for (size_t t = 0; t < seq_len; t++) {
+      const size_t d = h * mha_big.shards + t / shard_len;
+      const float *k =
+          mha_big.kc + (d * shard_len + t % shard_len) * head_size;
+      float score = 0.0f;
+      for (size_t j = 0; j < head_size; j++) {
+        score += q[j] * k[j];
+      }
+      att[t] = score / sqrtf(head_size);
+    }
+    softmax(att, seq_len);
+    for (size_t j = 0; j < head_size; j++) {
+      float x = 0.0f;
+      for (size_t t = 0; t < seq_len; t++) {
+        const size_t d = h * mha_big.shards + t / shard_len;
+        x += att[t] * mha_big.vc[(d * head_size + j) * shard_len +
+                                 t % shard_len];
+      }
+      error = fmaxf(error, fabsf(x - mha_big.x[h * head_size + j]));
+    }
+  }
+  free(att);
+  return error;
+}
 
-  DPU_FOREACH(dpu_set, dpu, i) { dpu_prepare_xfer(dpu, xb + i * head_size); }
-  dpu_push_xfer(dpu_set, DPU_XFER_FROM_DPU, "x", 0, head_size * sizeof(float),
-                DPU_XFER_DEFAULT);
+void math_bench(MathBench results[MATH_BENCH_FUNCTIONS]) {
+  // in the order of the kernel's functions
+  static const char *names[MATH_BENCH_FUNCTIONS] = {"exp", "recip", "sigmoid",
+                                                    "silu", "rsqrt"};
+  struct {
+    uint32_t cycles;
+    uint32_t fast_cycles;
+    float error;
+    uint32_t padding;
+  } kernel_results[MATH_BENCH_FUNCTIONS];
+
+  struct dpu_set_t dpu_set;
+  DPU_ASSERT(dpu_alloc(1, getenv("UPMEM_PROFILE"), &dpu_set));
+  DPU_ASSERT(dpu_load(dpu_set, "build/math_bench.kernel", nullptr));
+  DPU_ASSERT(dpu_launch(dpu_set, DPU_SYNCHRONOUS));
+  DPU_ASSERT(dpu_copy_from(dpu_set, "results", 0, kernel_results,
+                           sizeof(kernel_results)));
+  DPU_ASSERT(dpu_free(dpu_set));
+
+  for (size_t f = 0; f < MATH_BENCH_FUNCTIONS; f++) {
+    results[f].name = names[f];
+    results[f].cycles = kernel_results[f].cycles;
+    results[f].fast_cycles = kernel_results[f].fast_cycles;
+    results[f].error = kernel_results[f].error;
+  }
 }